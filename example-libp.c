@@ -25,6 +25,7 @@
 
 static struct libp_conn lc;
 static int is_sink = 0;
+static struct libp_tree tree;
 
 /*---------------------------------------------------------------------------*/
 PROCESS(example_libp_process, "Test LIBP process");
@@ -41,7 +42,14 @@ recv(const rimeaddr_t *originator, uint8_t seqno, uint8_t hops)
            (char *)packetbuf_dataptr());
 }
 /*---------------------------------------------------------------------------*/
-static const struct collect_callbacks callbacks = { recv };
+static void
+throttled(uint8_t level, clock_time_t wait)
+{
+    printf("Throttled at congestion level %d, wait %lu ticks\n",
+           level, (unsigned long)wait);
+}
+/*---------------------------------------------------------------------------*/
+static const struct libp_callbacks callbacks = { recv, throttled };
 /*---------------------------------------------------------------------------*/
 
 
@@ -51,7 +59,7 @@ PROCESS_THREAD(example_libp_process, ev, data)
     static struct etimer et;
 
     PROCESS_BEGIN();
-    libp_open(&lc, CHANNEL, LIBP_ROUTER, &callbacks);
+    libp_open(&lc, CHANNEL, LIBP_ROUTER, NULL, &callbacks);
 
     if(rimeaddr_node_addr.u8[0] == 1 &&
             rimeaddr_node_addr.u8[1] == 0)
@@ -62,7 +70,7 @@ PROCESS_THREAD(example_libp_process, ev, data)
         libp_set_sink(&lc, 1);
         is_sink = 1;
         libp_set_beacon_period(&lc, period);
-        tree_init(); //only gateway needs to use the tree methods
+        tree_init(&tree); //only gateway needs to use the tree methods
         process_start(&gateway_monitoring_process, NULL);
 
     }
@@ -95,7 +103,7 @@ PROCESS_THREAD(example_libp_process, ev, data)
             parent = libp_parent(&lc);
             packetbuf_set_datalen(sprintf(packetbuf_dataptr(),
                                           "%s %d", "Hello", (int)parent->u8[0]) + 1);
-            libp_send(&lc, 15);
+            libp_send(&lc, 15, LIBP_CLASS_ROUTINE, 0);
             
             parent = libp_parent(&lc);
             if(!rimeaddr_cmp(parent, &oldparent))
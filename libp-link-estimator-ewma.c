@@ -0,0 +1,83 @@
+/**
+ * \file
+ *         Source file for the EWMA libp link estimator
+ * \author
+ *         Lutando Ngqakaza <lutando.ngqakaza@gmail.com>
+ */
+
+#include "libp.h"
+#include "libp-link-metric.h"
+
+#if LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_EWMA
+
+#define ALPHA ((3 * (LIBP_LINK_METRIC_UNIT)) / 8)
+
+#define MAX_ESTIMATES 255
+
+/*---------------------------------------------------------------------------*/
+/* Blend an ETX sample, in LIBP_LINK_METRIC_UNIT units, into the
+   estimate. */
+static void
+update_etx(struct libp_link_estimator *e, uint32_t etx)
+{
+  if(e->num_estimates == 0) {
+    e->etx = etx;
+  }
+
+  if(e->num_estimates < MAX_ESTIMATES) {
+    e->num_estimates++;
+  }
+
+  e->etx = (etx * ALPHA +
+            e->etx * (LIBP_LINK_METRIC_UNIT - ALPHA)) /
+    LIBP_LINK_METRIC_UNIT;
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_new(struct libp_link_estimator *e)
+{
+  e->etx = 0;
+  e->num_estimates = 0;
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_tx(struct libp_link_estimator *e, uint8_t tx)
+{
+  update_etx(e, (uint32_t)tx * LIBP_LINK_METRIC_UNIT);
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_tx_fail(struct libp_link_estimator *e, uint8_t tx)
+{
+  /* A packet that never got through counts as if it had needed twice
+     the transmissions we made. */
+  update_etx(e, (uint32_t)tx * 2 * LIBP_LINK_METRIC_UNIT);
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_rx(struct libp_link_estimator *e,
+                              uint8_t received, uint8_t expected)
+{
+  if(received == 0) {
+    update_etx(e, (uint32_t)expected * 2 * LIBP_LINK_METRIC_UNIT);
+  } else {
+    update_etx(e, ((uint32_t)expected * LIBP_LINK_METRIC_UNIT) / received);
+  }
+}
+/*---------------------------------------------------------------------------*/
+uint16_t
+libp_link_estimator_metric(struct libp_link_estimator *e)
+{
+  if(e->num_estimates == 0) {
+    return LIBP_LINK_ESTIMATOR_INITIAL;
+  }
+  return e->etx > 0xffff ? 0xffff : e->etx;
+}
+/*---------------------------------------------------------------------------*/
+uint8_t
+libp_link_estimator_num_estimates(struct libp_link_estimator *e)
+{
+  return e->num_estimates;
+}
+/*---------------------------------------------------------------------------*/
+#endif /* LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_EWMA */
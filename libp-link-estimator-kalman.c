@@ -0,0 +1,111 @@
+/**
+ * \file
+ *         Source file for the Kalman libp link estimator
+ * \author
+ *         Lutando Ngqakaza <lutando.ngqakaza@gmail.com>
+ *
+ *         A scalar Kalman filter that models the ETX as a random walk.
+ *         The variance of the estimate grows by PROCESS_NOISE before
+ *         every sample and shrinks as samples come in, so the gain is
+ *         high for a new or recently changed link and settles once the
+ *         samples agree. Everything is in fixed point: the ETX in
+ *         LIBP_LINK_METRIC_UNIT units, the variances in that unit
+ *         squared and the gain in 1/GAIN_UNIT.
+ */
+
+#include "libp.h"
+#include "libp-link-metric.h"
+
+#if LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_KALMAN
+
+#ifdef LIBP_LINK_ESTIMATOR_CONF_PROCESS_NOISE
+#define PROCESS_NOISE LIBP_LINK_ESTIMATOR_CONF_PROCESS_NOISE
+#else /* LIBP_LINK_ESTIMATOR_CONF_PROCESS_NOISE */
+#define PROCESS_NOISE ((LIBP_LINK_METRIC_UNIT * LIBP_LINK_METRIC_UNIT) / 4)
+#endif /* LIBP_LINK_ESTIMATOR_CONF_PROCESS_NOISE */
+
+#ifdef LIBP_LINK_ESTIMATOR_CONF_MEASUREMENT_NOISE
+#define MEASUREMENT_NOISE LIBP_LINK_ESTIMATOR_CONF_MEASUREMENT_NOISE
+#else /* LIBP_LINK_ESTIMATOR_CONF_MEASUREMENT_NOISE */
+#define MEASUREMENT_NOISE (4 * LIBP_LINK_METRIC_UNIT * LIBP_LINK_METRIC_UNIT)
+#endif /* LIBP_LINK_ESTIMATOR_CONF_MEASUREMENT_NOISE */
+
+#define GAIN_UNIT 256
+
+#define MAX_ESTIMATES 255
+#define MAX_ETX 0xffff
+
+/*---------------------------------------------------------------------------*/
+static void
+update_etx(struct libp_link_estimator *e, uint32_t etx)
+{
+  uint32_t gain;
+  int32_t error;
+
+  if(etx > MAX_ETX) {
+    etx = MAX_ETX;
+  }
+
+  if(e->num_estimates == 0) {
+    e->etx = etx;
+    e->variance = MEASUREMENT_NOISE;
+  } else {
+    e->variance += PROCESS_NOISE;
+    gain = (e->variance * GAIN_UNIT) / (e->variance + MEASUREMENT_NOISE);
+    error = (int32_t)etx - (int32_t)e->etx;
+    e->etx = (int32_t)e->etx + (error * (int32_t)gain) / GAIN_UNIT;
+    e->variance = (e->variance * (GAIN_UNIT - gain)) / GAIN_UNIT;
+  }
+
+  if(e->num_estimates < MAX_ESTIMATES) {
+    e->num_estimates++;
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_new(struct libp_link_estimator *e)
+{
+  e->etx = 0;
+  e->variance = 0;
+  e->num_estimates = 0;
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_tx(struct libp_link_estimator *e, uint8_t tx)
+{
+  update_etx(e, (uint32_t)tx * LIBP_LINK_METRIC_UNIT);
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_tx_fail(struct libp_link_estimator *e, uint8_t tx)
+{
+  update_etx(e, (uint32_t)tx * 2 * LIBP_LINK_METRIC_UNIT);
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_rx(struct libp_link_estimator *e,
+                              uint8_t received, uint8_t expected)
+{
+  if(received == 0) {
+    update_etx(e, (uint32_t)expected * 2 * LIBP_LINK_METRIC_UNIT);
+  } else {
+    update_etx(e, ((uint32_t)expected * LIBP_LINK_METRIC_UNIT) / received);
+  }
+}
+/*---------------------------------------------------------------------------*/
+uint16_t
+libp_link_estimator_metric(struct libp_link_estimator *e)
+{
+  if(e->num_estimates == 0) {
+    return LIBP_LINK_ESTIMATOR_INITIAL;
+  }
+  return e->etx;
+}
+/*---------------------------------------------------------------------------*/
+uint8_t
+libp_link_estimator_num_estimates(struct libp_link_estimator *e)
+{
+  return e->num_estimates;
+}
+/*---------------------------------------------------------------------------*/
+#endif /* LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_KALMAN */
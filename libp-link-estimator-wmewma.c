@@ -0,0 +1,118 @@
+/**
+ * \file
+ *         Source file for the window mean with EWMA libp link estimator
+ * \author
+ *         Lutando Ngqakaza <lutando.ngqakaza@gmail.com>
+ *
+ *         Transmissions and ACKs are counted over a window of WINDOW
+ *         transmissions. When the window is full, its ETX is the
+ *         number of transmissions per ACK, and the estimate is an EWMA
+ *         of the window ETXs with a heavy weight on the history. This
+ *         is less sensitive to single lost packets than the plain EWMA.
+ */
+
+#include "libp.h"
+#include "libp-link-metric.h"
+
+#if LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_WMEWMA
+
+#ifdef LIBP_LINK_ESTIMATOR_CONF_WINDOW
+#define WINDOW LIBP_LINK_ESTIMATOR_CONF_WINDOW
+#else /* LIBP_LINK_ESTIMATOR_CONF_WINDOW */
+#define WINDOW 8
+#endif /* LIBP_LINK_ESTIMATOR_CONF_WINDOW */
+
+/* The weight of the history, in LIBP_LINK_METRIC_UNIT units. */
+#define HISTORY ((5 * (LIBP_LINK_METRIC_UNIT)) / 8)
+
+#define MAX_ESTIMATES 255
+#define MAX_ETX 0xffff
+
+/*---------------------------------------------------------------------------*/
+static void
+add(struct libp_link_estimator *e, uint8_t tx, uint8_t acked)
+{
+  uint32_t etx;
+
+  /* Keep the counters from wrapping: a sample larger than the space
+     left in the window closes it early. */
+  if(e->window_tx > 0xff - tx) {
+    tx = 0xff - e->window_tx;
+  }
+  e->window_tx += tx;
+  e->window_acked += acked;
+  if(e->window_tx < WINDOW) {
+    return;
+  }
+
+  if(e->window_acked == 0) {
+    /* Nothing got through: count the window as if every packet had
+       needed twice the transmissions made. */
+    etx = (uint32_t)e->window_tx * 2 * LIBP_LINK_METRIC_UNIT;
+  } else {
+    etx = ((uint32_t)e->window_tx * LIBP_LINK_METRIC_UNIT) / e->window_acked;
+  }
+  if(etx > MAX_ETX) {
+    etx = MAX_ETX;
+  }
+  e->window_tx = 0;
+  e->window_acked = 0;
+
+  if(e->num_estimates == 0) {
+    e->etx = etx;
+  } else {
+    e->etx = ((uint32_t)e->etx * HISTORY +
+              etx * (LIBP_LINK_METRIC_UNIT - HISTORY)) /
+      LIBP_LINK_METRIC_UNIT;
+  }
+  if(e->num_estimates < MAX_ESTIMATES) {
+    e->num_estimates++;
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_new(struct libp_link_estimator *e)
+{
+  e->etx = 0;
+  e->window_tx = 0;
+  e->window_acked = 0;
+  e->num_estimates = 0;
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_tx(struct libp_link_estimator *e, uint8_t tx)
+{
+  add(e, tx, 1);
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_tx_fail(struct libp_link_estimator *e, uint8_t tx)
+{
+  add(e, tx, 0);
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_link_estimator_update_rx(struct libp_link_estimator *e,
+                              uint8_t received, uint8_t expected)
+{
+  /* Every beacon the neighbour sent counts as a transmission and
+     every one we received as an ACK. */
+  add(e, expected, received);
+}
+/*---------------------------------------------------------------------------*/
+uint16_t
+libp_link_estimator_metric(struct libp_link_estimator *e)
+{
+  if(e->num_estimates == 0) {
+    return LIBP_LINK_ESTIMATOR_INITIAL;
+  }
+  return e->etx;
+}
+/*---------------------------------------------------------------------------*/
+uint8_t
+libp_link_estimator_num_estimates(struct libp_link_estimator *e)
+{
+  return e->num_estimates;
+}
+/*---------------------------------------------------------------------------*/
+#endif /* LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_WMEWMA */
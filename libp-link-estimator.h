@@ -0,0 +1,106 @@
+/**
+ * \file
+ *         Header file for the libp link estimators
+ * \author
+ *         Lutando Ngqakaza <lutando.ngqakaza@gmail.com>
+ *
+ *         The link estimator turns transmission and reception samples
+ *         into an ETX estimate for a link. The estimator is chosen at
+ *         compile time by setting LIBP_CONF_LINK_ESTIMATOR to one of
+ *         the LIBP_LINK_ESTIMATOR_* values, so the calls into it are
+ *         plain function calls. Only the source file of the chosen
+ *         estimator produces any code.
+ *
+ *         This file is included by libp-link-metric.h and needs
+ *         LIBP_LINK_METRIC_UNIT.
+ */
+
+#ifndef LIBP_LINK_ESTIMATOR_H
+#define LIBP_LINK_ESTIMATOR_H
+
+/* An exponentially weighted moving average of the ETX samples. */
+#define LIBP_LINK_ESTIMATOR_EWMA   1
+/* A window mean with EWMA: the samples are summed over a window of
+   transmissions and the ETX of each window is averaged. */
+#define LIBP_LINK_ESTIMATOR_WMEWMA 2
+/* A scalar Kalman filter that adapts its gain to how much the ETX
+   samples vary. */
+#define LIBP_LINK_ESTIMATOR_KALMAN 3
+
+#ifdef LIBP_CONF_LINK_ESTIMATOR
+#define LIBP_LINK_ESTIMATOR LIBP_CONF_LINK_ESTIMATOR
+#else /* LIBP_CONF_LINK_ESTIMATOR */
+#define LIBP_LINK_ESTIMATOR LIBP_LINK_ESTIMATOR_EWMA
+#endif /* LIBP_CONF_LINK_ESTIMATOR */
+
+/* The ETX reported for a link we have no samples for. */
+#define LIBP_LINK_ESTIMATOR_INITIAL (16 * LIBP_LINK_METRIC_UNIT)
+
+#if LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_EWMA
+struct libp_link_estimator {
+  uint32_t etx;
+  uint8_t num_estimates;
+};
+#elif LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_WMEWMA
+struct libp_link_estimator {
+  uint16_t etx;
+  uint8_t window_tx, window_acked;
+  uint8_t num_estimates;
+};
+#elif LIBP_LINK_ESTIMATOR == LIBP_LINK_ESTIMATOR_KALMAN
+struct libp_link_estimator {
+  uint16_t etx;
+  uint32_t variance;
+  uint8_t num_estimates;
+};
+#else
+#error "Unknown LIBP_LINK_ESTIMATOR"
+#endif
+
+/**
+ * \brief      Initialize a link estimator
+ * \param e    A pointer to a link estimator
+ */
+void libp_link_estimator_new(struct libp_link_estimator *e);
+
+/**
+ * \brief      Add the sample of a packet that was ACKed
+ * \param e    A pointer to a link estimator
+ * \param tx   The number of transmissions the packet needed, at least 1
+ */
+void libp_link_estimator_update_tx(struct libp_link_estimator *e,
+                                   uint8_t tx);
+
+/**
+ * \brief      Add the sample of a packet that was given up on
+ * \param e    A pointer to a link estimator
+ * \param tx   The number of transmissions made
+ */
+void libp_link_estimator_update_tx_fail(struct libp_link_estimator *e,
+                                        uint8_t tx);
+
+/**
+ * \brief      Add a reception sample
+ * \param e    A pointer to a link estimator
+ * \param received The number of packets received from the neighbour
+ * \param expected The number of packets the neighbour sent, at least
+ *             received and at least 1
+ */
+void libp_link_estimator_update_rx(struct libp_link_estimator *e,
+                                   uint8_t received, uint8_t expected);
+
+/**
+ * \brief      Get the ETX of a link
+ * \param e    A pointer to a link estimator
+ * \return     The ETX in LIBP_LINK_METRIC_UNIT units, or
+ *             LIBP_LINK_ESTIMATOR_INITIAL if there is no estimate yet
+ */
+uint16_t libp_link_estimator_metric(struct libp_link_estimator *e);
+
+/**
+ * \brief      Get the number of estimates made, saturating at 255
+ * \param e    A pointer to a link estimator
+ */
+uint8_t libp_link_estimator_num_estimates(struct libp_link_estimator *e);
+
+#endif
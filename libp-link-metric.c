@@ -8,11 +8,14 @@
 #include "libp.h"
 #include "libp-link-metric.h"
 
-#define INITIAL_LINK_METRIC 16
-
 #define LIBP_LINK_METRIC_ALPHA ((3 * (LIBP_LINK_METRIC_UNIT)) / 8)
 
-#define MAX_ESTIMATES 255
+/* The reception ratio is measured over windows of RX_WINDOW expected
+   beacons. A gap of more than RX_MAX_GAP beacons means that the
+   neighbour has restarted its sequence numbers or that we have not
+   been listening, so the window starts over. */
+#define RX_WINDOW   5
+#define RX_MAX_GAP  32
 
 #define DEBUG 0
 #if DEBUG
@@ -29,10 +32,11 @@ void libp_link_metric_new(struct libp_link_metric *lm)
         return;
     }
     lm->num_children = 0;
-    lm->children_accumulator = LIBP_LINK_METRIC_UNIT;
+    lm->children_accumulator = 0;
+    libp_link_estimator_new(&lm->etx);
+    lm->rx_valid = 0;
 }
 
-
 void libp_link_metric_update_tx(struct libp_link_metric *lm, uint8_t tx)
 {
     if(lm == NULL) {
@@ -42,22 +46,7 @@ void libp_link_metric_update_tx(struct libp_link_metric *lm, uint8_t tx)
     /*    printf("ERROR tx == 0\n");*/
     return;
   }
-  if(lm != NULL) {
-    if(lm->num_estimates == 0) {
-      lm->etx_accumulator = tx * LIBP_LINK_METRIC_UNIT;
-    }
-
-    if(lm->num_estimates < MAX_ESTIMATES) {
-      lm->num_estimates++;
-    }
-
-    lm->etx_accumulator = (((uint32_t)tx * LIBP_LINK_METRIC_UNIT) *
-                           LIBP_LINK_METRIC_ALPHA +
-                           lm->etx_accumulator * (LIBP_LINK_METRIC_UNIT -
-                                                  LIBP_LINK_METRIC_ALPHA)) /
-      LIBP_LINK_METRIC_UNIT;
-
-  }
+  libp_link_estimator_update_tx(&lm->etx, tx);
 }
 
 
@@ -66,12 +55,44 @@ void libp_link_metric_update_tx_fail(struct libp_link_metric *lm,uint8_t tx)
     if(lm == NULL) {
     return;
   }
-  libp_link_metric_update_tx(lm, tx * 2);
+  if(tx == 0) {
+    return;
+  }
+  libp_link_estimator_update_tx_fail(&lm->etx, tx);
 }
 
-void libp_link_metric_update_rx(struct libp_link_metric *lm)
+void libp_link_metric_update_rx(struct libp_link_metric *lm, uint8_t seqno)
 {
+    uint8_t gap;
+
+    if(lm == NULL) {
+        return;
+    }
 
+    gap = seqno - lm->rx_seqno;
+    if(!lm->rx_valid || gap > RX_MAX_GAP) {
+        lm->rx_valid = 1;
+        lm->rx_seqno = seqno;
+        lm->rx_received = 1;
+        lm->rx_expected = 1;
+        return;
+    }
+    if(gap == 0) {
+        /* A duplicate. */
+        return;
+    }
+
+    lm->rx_seqno = seqno;
+    lm->rx_received++;
+    lm->rx_expected += gap;
+    if(lm->rx_expected >= RX_WINDOW) {
+        PRINTF("libp_link_metric_update_rx: %d of %d\n",
+               lm->rx_received, lm->rx_expected);
+        libp_link_estimator_update_rx(&lm->etx, lm->rx_received,
+                                      lm->rx_expected);
+        lm->rx_received = 0;
+        lm->rx_expected = 0;
+    }
 }
 
 
@@ -81,17 +102,40 @@ uint16_t libp_link_metric(struct libp_link_metric *lm)
    if(lm == NULL) {
     return 0;
   }
-  if(lm->num_estimates == 0) {
-    return INITIAL_LINK_METRIC * LIBP_LINK_METRIC_UNIT;
-  }
+  return libp_link_estimator_metric(&lm->etx);
+}
+
+void libp_link_metric_update_children(struct libp_link_metric *lm,
+                                      uint8_t children)
+{
+    if(lm == NULL) {
+        return;
+    }
+    if(lm->children_accumulator == 0) {
+        lm->children_accumulator = children * LIBP_LINK_METRIC_UNIT;
+    } else {
+        lm->children_accumulator = (((uint32_t)children * LIBP_LINK_METRIC_UNIT) *
+                                    LIBP_LINK_METRIC_ALPHA +
+                                    lm->children_accumulator *
+                                    (LIBP_LINK_METRIC_UNIT -
+                                     LIBP_LINK_METRIC_ALPHA)) /
+          LIBP_LINK_METRIC_UNIT;
+    }
+    lm->num_children = children;
+}
 
-  return lm->etx_accumulator;
+uint16_t libp_link_metric_children(struct libp_link_metric *lm)
+{
+    if(lm == NULL) {
+        return 0;
+    }
+    return lm->children_accumulator;
 }
 
 int libp_link_metric_num_metrics(struct libp_link_metric *lm)
 {
     if(lm != NULL) {
-        return lm->num_estimates;
+        return libp_link_estimator_num_estimates(&lm->etx);
     }
     return 0;
 }
@@ -10,11 +10,14 @@
 
 #define LIBP_LINK_METRIC_UNIT           8
 
+#include "libp-link-estimator.h"
+
 struct libp_link_metric {
   uint32_t children_accumulator;
   uint8_t num_children;
-  uint32_t etx_accumulator;
-  uint8_t num_estimates;
+  struct libp_link_estimator etx;
+  uint8_t rx_seqno, rx_received, rx_expected;
+  uint8_t rx_valid;
 };
 
 /**
@@ -52,15 +55,18 @@ void libp_link_metric_update_tx_fail(struct libp_link_metric *lm,
                                           uint8_t num_tx);
 
 /**
- * \brief      Update a link metric when a packet has been received.
+ * \brief      Update a link metric when a beacon has been received.
  * \param le   A pointer to a link metric structure
+ * \param seqno The sequence number of the beacon
  *
  *             This function updates a link metric. This function is
- *             called when a packet has been received. The function
- *             uses information from the packet buffer and its
- *             attributes.
+ *             called when a beacon has been received from the
+ *             neighbour. The gaps in the beacon sequence numbers give
+ *             the inbound packet reception ratio, which is handed to
+ *             the link estimator along with the samples from our own
+ *             transmissions.
  */
-void libp_link_metric_update_rx(struct libp_link_metric *lm);
+void libp_link_metric_update_rx(struct libp_link_metric *lm, uint8_t seqno);
 
 
 /**
@@ -73,4 +79,23 @@ uint16_t libp_link_metric(struct libp_link_metric *lm);
 
 int libp_link_metric_num_metrics(struct libp_link_metric *lm);
 
+/**
+ * \brief      Update the supporting children count of a link
+ * \param lm   A pointer to a link metric structure
+ * \param children The number of children the neighbour advertised
+ *
+ *             This function is called when a neighbour advertises
+ *             how many children it currently forwards packets for.
+ */
+void libp_link_metric_update_children(struct libp_link_metric *lm,
+                                      uint8_t children);
+
+/**
+ * \brief      Compute the smoothed supporting children count of a link
+ * \param lm   A pointer to a link metric structure
+ * \return     The number of children, in LIBP_LINK_METRIC_UNIT units
+ *
+ */
+uint16_t libp_link_metric_children(struct libp_link_metric *lm);
+
 #endif
@@ -8,6 +8,7 @@
 
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "contiki.h"
 #include "lib/memb.h"
@@ -16,22 +17,60 @@
 #include "libp-neighbour.h"
 #include "libp.h"
 
-#ifdef LIBP_NEIGHBOUR_CONF_MAX_LIBP_NEIGHBOURS
-#define MAX_LIBP_NEIGHBOURS COLLECT_NEIGHBOR_CONF_MAX_LIBP_NEIGHBOURS
-#else /* COLLECT_NEIGHBOR_CONF_MAX_LIBP_NEIGHBOURS */
-#define MAX_LIBP_NEIGHBOURS 8
-#endif /* COLLECT_NEIGHBOR_CONF_MAX_LIBP_NEIGHBOURS */
-
 #define RTMETRIC_MAX LIBP_MAX_DEPTH
 
-MEMB(libp_neighbours_mem, struct libp_neighbour, MAX_LIBP_NEIGHBOURS);
-
-#define MAX_AGE                      180
-#define MAX_LM_AGE                   10
-#define PERIODIC_INTERVAL            CLOCK_SECOND * 60
-
-#define EXPECTED_CONGESTION_DURATION CLOCK_SECOND * 240
-#define CONGESTION_PENALTY           8 * LIBP_LINK_METRIC_UNIT
+/* A neighbour is forgotten when it has not been heard for MAX_AGE
+   seconds, and its link estimate is restarted when it has not been
+   updated for MAX_LM_AGE seconds. */
+#define MAX_AGE                      (180 * 60UL)
+#define MAX_LM_AGE                   (10 * 60UL)
+
+/* The round-trip time estimator follows Jacobson and Karels: the
+   smoothed round-trip time is kept scaled by 8 and the mean deviation
+   scaled by 4, so the gains are 1/8 and 1/4. Samples are capped so
+   that the scaled values fit in 16 bits. */
+#define RTT_SHIFT                    3
+#define RTTVAR_SHIFT                 2
+#define MAX_RTT_SAMPLE               ((1 << (16 - RTT_SHIFT)) - 1)
+
+/* The cost of choosing a neighbour as parent grows by CHILD_WEIGHT
+   for every child the neighbour already forwards for, so that the
+   forwarding load is spread over the neighbours that offer a similar
+   path to the sink. */
+#ifdef LIBP_NEIGHBOUR_CONF_CHILD_WEIGHT
+#define CHILD_WEIGHT LIBP_NEIGHBOUR_CONF_CHILD_WEIGHT
+#else /* LIBP_NEIGHBOUR_CONF_CHILD_WEIGHT */
+#define CHILD_WEIGHT                 (LIBP_LINK_METRIC_UNIT / 2)
+#endif /* LIBP_NEIGHBOUR_CONF_CHILD_WEIGHT */
+
+/* When the pool is full, a new neighbour replaces the neighbour we
+   would least like to keep: the one with the highest parent cost,
+   after adding AGE_PENALTY for every minute it has not been heard and
+   subtracting CONFIDENCE_BONUS for every link estimate (up to
+   MAX_CONFIDENCE) we hold for it. The newcomer must be better by
+   EVICTION_HYSTERESIS, and the current best neighbour is never
+   replaced. */
+#define AGE_PENALTY                  (LIBP_LINK_METRIC_UNIT / 2)
+#define CONFIDENCE_BONUS             (LIBP_LINK_METRIC_UNIT / 2)
+#define MAX_CONFIDENCE               8
+#define EVICTION_HYSTERESIS          (2 * LIBP_LINK_METRIC_UNIT)
+
+/* Every ACK that says a neighbour is congested raises its congestion
+   score by CONGESTED_STEP, and every ACK that says it dropped our
+   packet by DROPPED_STEP, up to 255. The score halves every
+   CONGESTION_HALF_LIFE seconds, decaying linearly within each
+   half-life, and adds up to CONGESTION_PENALTY to the link metric.
+   While any score takes part in choosing the best neighbour, the
+   choice is revisited every CONGESTION_RECHECK. */
+#define CONGESTED_STEP               96
+#define DROPPED_STEP                 32
+#ifdef LIBP_NEIGHBOUR_CONF_CONGESTION_HALF_LIFE
+#define CONGESTION_HALF_LIFE LIBP_NEIGHBOUR_CONF_CONGESTION_HALF_LIFE
+#else /* LIBP_NEIGHBOUR_CONF_CONGESTION_HALF_LIFE */
+#define CONGESTION_HALF_LIFE         60
+#endif /* LIBP_NEIGHBOUR_CONF_CONGESTION_HALF_LIFE */
+#define CONGESTION_PENALTY           (8 * LIBP_LINK_METRIC_UNIT)
+#define CONGESTION_RECHECK           ((CONGESTION_HALF_LIFE * CLOCK_SECOND) / 4)
 
 #define DEBUG 0
 #if DEBUG
@@ -43,43 +82,164 @@ MEMB(libp_neighbours_mem, struct libp_neighbour, MAX_LIBP_NEIGHBOURS);
 
 /*---------------------------------------------------------------------------*/
 static void
-periodic(void *ptr)
+best_invalidate(struct libp_neighbour_list *neighbour_list)
 {
-  struct libp_neighbour_list *neighbour_list;
-  struct libp_neighbour *n;
-
-  neighbour_list = ptr;
+  neighbour_list->best_valid = 0;
+  neighbour_list->backups_valid = 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Called when the rtmetric or the link metric of n has changed, with
+ * the parent cost n had before. A neighbour that becomes cheaper than
+ * the cached best takes its place; if the best itself got more
+ * expensive, the best has to be searched for again. Returns how much
+ * the cost of n changed, or LIBP_NEIGHBOUR_BEST_CHANGED.
+ */
+static uint16_t
+neighbour_changed(struct libp_neighbour *n, uint16_t old_cost)
+{
+  struct libp_neighbour_list *neighbour_list = n->list;
+  uint16_t cost;
 
-  /* Go through all libp_neighbours and increase their age. */
-  for(n = list_head(neighbour_list->list); n != NULL; n = list_item_next(n)) {
-    n->age++;
-    n->lm_age++;
+  cost = libp_neighbour_parent_cost(n, 0);
+  if(neighbour_list == NULL || !neighbour_list->best_valid) {
+    return LIBP_NEIGHBOUR_BEST_CHANGED;
   }
-  for(n = list_head(neighbour_list->list); n != NULL; n = list_item_next(n)) {
-    if(n->lm_age == MAX_LM_AGE) {
-      libp_link_metric_new(&n->lm);
-      n->lm_age = 0;
+  neighbour_list->backups_valid = 0;
+  if(libp_neighbour_rtmetric_link_metric(n) >= RTMETRIC_MAX) {
+    if(n == neighbour_list->best) {
+      best_invalidate(neighbour_list);
+      return LIBP_NEIGHBOUR_BEST_CHANGED;
     }
-    if(n->age == MAX_AGE) {
-      memb_free(&libp_neighbours_mem, n);
-      list_remove(neighbour_list->list, n);
-      n = list_head(neighbour_list->list);
+    return 0;
+  }
+  if(n == neighbour_list->best) {
+    if(cost <= neighbour_list->best_cost) {
+      neighbour_list->best_cost = cost;
+    } else {
+      best_invalidate(neighbour_list);
+      return LIBP_NEIGHBOUR_BEST_CHANGED;
     }
+  } else if(neighbour_list->best == NULL || cost < neighbour_list->best_cost) {
+    neighbour_list->best = n;
+    neighbour_list->best_cost = cost;
+    return LIBP_NEIGHBOUR_BEST_CHANGED;
+  }
+  return cost > old_cost ? cost - old_cost : old_cost - cost;
+}
+/*---------------------------------------------------------------------------*/
+static void
+neighbour_free(struct libp_neighbour_list *neighbour_list,
+               struct libp_neighbour *n)
+{
+  list_remove(neighbour_list->list, n);
+  memb_free(neighbour_list->memb, n);
+  if(neighbour_list->last_found == n) {
+    neighbour_list->last_found = NULL;
+  }
+  best_invalidate(neighbour_list);
+}
+/*---------------------------------------------------------------------------*/
+/* Apply the whole half-lives that have passed to the congestion score
+   of n. The time is kept in 16 bits; the lazy expiry walk decays every
+   score at least every MAX_LM_AGE, long before it could wrap. */
+static void
+congestion_decay(struct libp_neighbour *n, uint16_t now)
+{
+  uint16_t halvings;
+
+  if(n->congestion == 0) {
+    n->congestion_time = now;
+    return;
+  }
+  halvings = (uint16_t)(now - n->congestion_time) / CONGESTION_HALF_LIFE;
+  if(halvings >= 8) {
+    n->congestion = 0;
+    n->congestion_time = now;
+  } else {
+    n->congestion >>= halvings;
+    n->congestion_time += halvings * CONGESTION_HALF_LIFE;
   }
-  ctimer_set(&neighbour_list->periodic, PERIODIC_INTERVAL,
-             periodic, neighbour_list);
 }
 /*---------------------------------------------------------------------------*/
+static uint16_t
+congestion_add(struct libp_neighbour *n, uint8_t step)
+{
+  uint16_t old_cost;
 
-void libp_neighbour_init(void)
+  if(n == NULL) {
+    return 0;
+  }
+  old_cost = libp_neighbour_parent_cost(n, 0);
+  congestion_decay(n, clock_seconds());
+  n->congestion = n->congestion > 255 - step ? 255 : n->congestion + step;
+  return neighbour_changed(n, old_cost);
+}
+/*---------------------------------------------------------------------------*/
+static void
+expiry_update(struct libp_neighbour_list *neighbour_list, unsigned long t)
 {
-    static uint8_t initialized = 0;
-    if(initialized == 0) {
-        initialized = 1;
-        memb_init(&libp_neighbours_mem);
+  if((long)(t - neighbour_list->next_expiry) < 0) {
+    neighbour_list->next_expiry = t;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Forget the neighbours that have not been heard for too long and
+ * restart the link estimates that are too old. This only walks the
+ * list once the earliest expiry time has passed, so it is cheap enough
+ * to call on every lookup.
+ */
+static void
+expire(struct libp_neighbour_list *neighbour_list)
+{
+  struct libp_neighbour *n, *next;
+  unsigned long now;
+
+  now = clock_seconds();
+  if((long)(now - neighbour_list->next_expiry) < 0) {
+    return;
+  }
+
+  neighbour_list->next_expiry = now + MAX_LM_AGE;
+  for(n = list_head(neighbour_list->list); n != NULL; n = next) {
+    next = list_item_next(n);
+    if(now - n->last_heard >= MAX_AGE) {
+      PRINTF("libp_neighbour expire: %d.%d\n", n->addr.u8[0], n->addr.u8[1]);
+      neighbour_free(neighbour_list, n);
+      continue;
     }
+    congestion_decay(n, now);
+    if(now - n->last_estimated >= MAX_LM_AGE) {
+      libp_link_metric_new(&n->lm);
+      n->last_estimated = now;
+      best_invalidate(neighbour_list);
+    }
+    expiry_update(neighbour_list, n->last_heard + MAX_AGE);
+    expiry_update(neighbour_list, n->last_estimated + MAX_LM_AGE);
+  }
 }
+/*---------------------------------------------------------------------------*/
 
+/*---------------------------------------------------------------------------*/
+/**
+ * How much we would rather not keep n: its parent cost, made worse by
+ * its age and better by the confidence we have in its link estimate.
+ */
+static int32_t
+eviction_score(struct libp_neighbour *n)
+{
+  int estimates;
+
+  estimates = libp_link_metric_num_metrics(&n->lm);
+  if(estimates > MAX_CONFIDENCE) {
+    estimates = MAX_CONFIDENCE;
+  }
+  return (int32_t)libp_neighbour_parent_cost(n, 0) +
+    (int32_t)((clock_seconds() - n->last_heard) / 60) * AGE_PENALTY -
+    estimates * CONFIDENCE_BONUS;
+}
+/*---------------------------------------------------------------------------*/
 list_t libp_neighbour_list(struct libp_neighbour_list *neighbour_list)
 {
     if(neighbour_list == NULL) {
@@ -89,14 +249,29 @@ list_t libp_neighbour_list(struct libp_neighbour_list *neighbour_list)
     return neighbour_list->list;
 }
 
-void libp_neighbour_list_new(struct libp_neighbour_list *neighbours_list)
+void libp_neighbour_list_new(struct libp_neighbour_list *neighbours_list,
+                             struct memb *memb)
 {
 LIST_STRUCT_INIT(neighbours_list, list);
   list_init(neighbours_list->list);
-  ctimer_set(&neighbours_list->periodic, CLOCK_SECOND, periodic, neighbours_list);
+  neighbours_list->memb = memb;
+  neighbours_list->best = NULL;
+  neighbours_list->last_found = NULL;
+  neighbours_list->best_valid = 0;
+  neighbours_list->backups_valid = 0;
+  neighbours_list->backups_parent = NULL;
+  neighbours_list->feasible_rtmetric = RTMETRIC_MAX;
+  neighbours_list->next_expiry = clock_seconds() + MAX_LM_AGE;
 }
 
-int libp_neighbour_list_add(struct libp_neighbour_list *neighbours_list,const rimeaddr_t *addr, uint16_t nrtmetric)
+/**
+ * Add the neighbour addr, or refresh it if it is on the list. When the
+ * list is full, the neighbour least likely to be used is recycled, but
+ * never the best neighbour or parent, the one packets are currently
+ * sent to, which may be NULL.
+ */
+int libp_neighbour_list_add(struct libp_neighbour_list *neighbours_list,const rimeaddr_t *addr, uint16_t nrtmetric,
+                            const rimeaddr_t *parent)
 {
    struct libp_neighbour *n;
 
@@ -111,6 +286,8 @@ int libp_neighbour_list_add(struct libp_neighbour_list *neighbours_list,const ri
 
   PRINTF("libp_neighbor_add: adding %d.%d\n", addr->u8[0], addr->u8[1]);
 
+  expire(neighbours_list);
+
   /* Check if the libp_neighbor is already on the list. */
   for(n = list_head(neighbours_list->list); n != NULL; n = list_item_next(n)) {
     if(rimeaddr_cmp(&n->addr, addr)) {
@@ -125,39 +302,44 @@ int libp_neighbour_list_add(struct libp_neighbour_list *neighbours_list,const ri
   if(n == NULL) {
     PRINTF("libp_neighbor_add: not on list, allocating %d.%d\n",
            addr->u8[0], addr->u8[1]);
-    n = memb_alloc(&libp_neighbours_mem);
+    n = memb_alloc(neighbours_list->memb);
     if(n != NULL) {
       list_add(neighbours_list->list, n);
     }
   }
 
   /* If we could not allocate memory, we try to recycle an old
-     neighbor. XXX Should also look for the one with the worst
-     rtmetric (not link esimate). XXX Also make sure that we don't
-     replace a neighbor with a neighbor that has a worse metric. */
+     neighbor. */
   if(n == NULL) {
-    uint16_t worst_rtmetric;
-    struct libp_neighbour *worst_neighbour;
-
-    /* Find the neighbor that has the highest rtmetric. This is the
-       neighbor that we are least likely to be using in the
-       future. But we also need to make sure that the neighbor we are
-       currently adding is not worst than the one we would be
-       replacing. If so, we don't put the new neighbor on the list. */
-    worst_rtmetric = 0;
+    int32_t worst_score, score;
+    struct libp_neighbour *worst_neighbour, *best;
+    struct libp_link_metric unknown;
+
+    /* Find the neighbor that we are least likely to be using in the
+       future, sparing the best one and the parent. But we also need to make sure
+       that the neighbor we are currently adding, of which we know
+       nothing but its rtmetric, is clearly better than the one we
+       would be replacing. If not, we don't put the new neighbor on
+       the list. */
+    best = libp_neighbour_list_best(neighbours_list);
+    worst_score = 0;
     worst_neighbour = NULL;
 
     for(n = list_head(neighbours_list->list);
         n != NULL; n = list_item_next(n)) {
-      if(n->rtmetric > worst_rtmetric) {
+      score = eviction_score(n);
+      if(n != best && (parent == NULL || !rimeaddr_cmp(&n->addr, parent)) &&
+         (worst_neighbour == NULL || score > worst_score)) {
         worst_neighbour = n;
-        worst_rtmetric = n->rtmetric;
+        worst_score = score;
       }
     }
 
-    /* Only add this new neighbor if its rtmetric is lower than the
-       one it would replace. */
-    if(nrtmetric < worst_rtmetric) {
+    n = NULL;
+    libp_link_metric_new(&unknown);
+    score = (int32_t)nrtmetric + libp_link_metric(&unknown) +
+      EVICTION_HYSTERESIS;
+    if(worst_neighbour != NULL && score < worst_score) {
       n = worst_neighbour;
     }
     if(n != NULL) {
@@ -167,12 +349,22 @@ int libp_neighbour_list_add(struct libp_neighbour_list *neighbours_list,const ri
   }
 
   if(n != NULL) {
-    n->age = 0;
+    if(neighbours_list->last_found == n) {
+      neighbours_list->last_found = NULL;
+    }
+    best_invalidate(neighbours_list);
+    n->list = neighbours_list;
+    n->last_heard = clock_seconds();
+    n->last_estimated = n->last_heard;
+    expiry_update(neighbours_list, n->last_estimated + MAX_LM_AGE);
     rimeaddr_copy(&n->addr, addr);
     n->rtmetric = nrtmetric;
     libp_link_metric_new(&n->lm);
-    n->lm_age = 0;
     n->penalty = 0;
+    n->congestion = 0;
+    n->congestion_time = n->last_heard;
+    n->srtt = 0;
+    n->rttvar = 0;
     return 1;
   }
   return 0;
@@ -180,7 +372,7 @@ int libp_neighbour_list_add(struct libp_neighbour_list *neighbours_list,const ri
 
 void libp_neighbour_list_remove(struct libp_neighbour_list *neighbours_list,const rimeaddr_t *addr)
 {
- struct libp_neighbor *n;
+ struct libp_neighbour *n;
 
   if(neighbours_list == NULL) {
     return;
@@ -189,8 +381,7 @@ void libp_neighbour_list_remove(struct libp_neighbour_list *neighbours_list,cons
   n = libp_neighbour_list_find(neighbours_list, addr);
 
   if(n != NULL) {
-    list_remove(neighbours_list->list, n);
-    memb_free(&libp_neighbours_mem, n);
+    neighbour_free(neighbours_list, n);
   }
 }
 
@@ -200,8 +391,14 @@ struct libp_neighbour *libp_neighbour_list_find(struct libp_neighbour_list *neig
   if(neighbours_list == NULL) {
     return NULL;
   }
+  expire(neighbours_list);
+  if(neighbours_list->last_found != NULL &&
+     rimeaddr_cmp(&neighbours_list->last_found->addr, addr)) {
+    return neighbours_list->last_found;
+  }
   for(n = list_head(neighbours_list->list); n != NULL; n = list_item_next(n)) {
     if(rimeaddr_cmp(&n->addr, addr)) {
+      neighbours_list->last_found = n;
       return n;
     }
   }
@@ -218,37 +415,122 @@ uint16_t libp_neighbour_rtmetric_link_metric(struct libp_neighbour *n)
 
 struct libp_neighbour *libp_neighbour_list_best(struct libp_neighbour_list *neighbours_list)
 {
-    int found;
   struct libp_neighbour *n, *best;
-  uint16_t rtmetric;
-
-  rtmetric = RTMETRIC_MAX;
-  best = NULL;
-  found = 0;
+  uint16_t cost, best_cost;
 
   if(neighbours_list == NULL) {
     return NULL;
   }
 
+  expire(neighbours_list);
+  if(neighbours_list->best_valid &&
+     (!neighbours_list->best_has_expiry ||
+      CLOCK_LT(clock_time(), neighbours_list->best_expires))) {
+    return neighbours_list->best;
+  }
+
   /*  PRINTF("%d: ", node_id);*/
   PRINTF("libp_neighbor_best: ");
 
-  /* Find the neighbor with the lowest rtmetric + linkt estimate. */
+  /* Find the neighbor with the lowest parent cost among those that
+     offer a route: rtmetric + link estimate + children load. If a
+     congestion penalty took part, it keeps decaying and the choice
+     has to be revisited. */
+  best = NULL;
+  best_cost = 0;
+  neighbours_list->best_has_expiry = 0;
   for(n = list_head(neighbours_list->list); n != NULL; n = list_item_next(n)) {
-    PRINTF("%d.%d %d+%d=%d, ",
+    PRINTF("%d.%d %d+%d+%d, ",
            n->addr.u8[0], n->addr.u8[1],
            n->rtmetric, libp_neighbour_link_metric(n),
-           libp_neighbour_rtmetric(n));
-    if(libp_neighbour_rtmetric_link_metric(n) < rtmetric) {
-      rtmetric = libp_neighbour_rtmetric_link_metric(n);
+           libp_link_metric_children(&n->lm));
+    if(libp_neighbour_rtmetric_link_metric(n) >= RTMETRIC_MAX) {
+      continue;
+    }
+    if(libp_neighbour_is_congested(n) && !neighbours_list->best_has_expiry) {
+      neighbours_list->best_expires = clock_time() + CONGESTION_RECHECK;
+      neighbours_list->best_has_expiry = 1;
+    }
+    cost = libp_neighbour_parent_cost(n, 0);
+    if(best == NULL || cost < best_cost) {
+      best_cost = cost;
       best = n;
     }
   }
   PRINTF("\n");
 
+  neighbours_list->best = best;
+  neighbours_list->best_cost = best_cost;
+  neighbours_list->best_valid = 1;
   return best;
 }
 
+/*---------------------------------------------------------------------------*/
+/**
+ * The backup parent of the given rank, from 0, or NULL if there are
+ * not that many feasible neighbours besides the parent. The backups
+ * are ranked by parent cost. The parent is the one packets are
+ * currently sent to, which the hysteresis may keep for a while after
+ * another neighbour has become the best, so the best neighbour can be
+ * a backup.
+ */
+struct libp_neighbour *libp_neighbour_list_backup(struct libp_neighbour_list *neighbours_list,
+                                                  struct libp_neighbour *parent,
+                                                  int rank)
+{
+  struct libp_neighbour *n;
+  uint16_t cost;
+  int i, k;
+
+  if(neighbours_list == NULL || rank < 0 || rank >= LIBP_NEIGHBOUR_BACKUPS) {
+    return NULL;
+  }
+
+  /* Expire old neighbours before ranking them. */
+  libp_neighbour_list_best(neighbours_list);
+  if(!neighbours_list->backups_valid ||
+     neighbours_list->backups_parent != parent) {
+    /* Insertion into the short ranked array. */
+    memset(neighbours_list->backups, 0, sizeof(neighbours_list->backups));
+    neighbours_list->backups_parent = parent;
+    for(n = list_head(neighbours_list->list); n != NULL; n = list_item_next(n)) {
+      if(n == parent || n->rtmetric >= neighbours_list->feasible_rtmetric ||
+         libp_neighbour_rtmetric_link_metric(n) >= RTMETRIC_MAX) {
+        continue;
+      }
+      cost = libp_neighbour_parent_cost(n, 0);
+      for(i = 0; i < LIBP_NEIGHBOUR_BACKUPS; i++) {
+        if(neighbours_list->backups[i] == NULL ||
+           cost < libp_neighbour_parent_cost(neighbours_list->backups[i], 0)) {
+          break;
+        }
+      }
+      if(i < LIBP_NEIGHBOUR_BACKUPS) {
+        for(k = LIBP_NEIGHBOUR_BACKUPS - 1; k > i; k--) {
+          neighbours_list->backups[k] = neighbours_list->backups[k - 1];
+        }
+        neighbours_list->backups[i] = n;
+      }
+    }
+    neighbours_list->backups_valid = 1;
+  }
+  return neighbours_list->backups[rank];
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Only neighbours with an rtmetric below rtmetric, normally our own,
+ * are ranked as backups, so that failing over cannot create a loop.
+ */
+void libp_neighbour_list_set_feasible(struct libp_neighbour_list *neighbours_list,
+                                      uint16_t rtmetric)
+{
+  if(neighbours_list == NULL || neighbours_list->feasible_rtmetric == rtmetric) {
+    return;
+  }
+  neighbours_list->feasible_rtmetric = rtmetric;
+  neighbours_list->backups_valid = 0;
+}
+/*---------------------------------------------------------------------------*/
 int libp_neighbour_list_num(struct libp_neighbour_list *neighbours_list)
 {
     if(neighbours_list == NULL) {
@@ -289,80 +571,157 @@ void libp_neighbour_list_purge(struct libp_neighbour_list *neighbour_list)
     }
 
     while(list_head(neighbour_list->list) != NULL) {
-        memb_free(&libp_neighbours_mem, list_pop(neighbour_list->list));
+        memb_free(neighbour_list->memb, list_pop(neighbour_list->list));
     }
+    neighbour_list->best = NULL;
+    neighbour_list->last_found = NULL;
+    best_invalidate(neighbour_list);
 }
 
-void libp_neighbour_update_rtmetric(struct libp_neighbour *n, uint16_t rtmetric)
+uint16_t libp_neighbour_update_rtmetric(struct libp_neighbour *n, uint16_t rtmetric)
 {
+  uint16_t old_cost;
+
     if(n != NULL) {
     PRINTF("%d.%d: libp_neighbour_update %d.%d rtmetric %d\n",
            rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
            n->addr.u8[0], n->addr.u8[1], rtmetric);
+    n->last_heard = clock_seconds();
+    if(n->rtmetric == rtmetric) {
+      return 0;
+    }
+    old_cost = libp_neighbour_parent_cost(n, 0);
     n->rtmetric = rtmetric;
-    n->age = 0;
+    return neighbour_changed(n, old_cost);
   }
+  return 0;
 }
 
-void libp_neighbour_tx(struct libp_neighbour *n, uint16_t num_tx)
+uint16_t libp_neighbour_tx(struct libp_neighbour *n, uint16_t num_tx)
 {
+  uint16_t old_cost;
+
   if(n == NULL) {
-    return;
+    return 0;
   }
+  old_cost = libp_neighbour_parent_cost(n, 0);
   libp_link_metric_update_tx(&n->lm, num_tx);
-  n->lm_age = 0;
-  n->age = 0;
+  n->last_heard = clock_seconds();
+  n->last_estimated = n->last_heard;
+  return neighbour_changed(n, old_cost);
 }
-void libp_neighbour_rx(struct libp_neighbour *n)
+uint16_t libp_neighbour_rx(struct libp_neighbour *n, uint8_t seqno)
 {
+  uint16_t old_cost;
+
  if(n == NULL) {
-    return;
+    return 0;
   }
-  libp_link_metric_update_rx(&n->lm);
-  n->age = 0;
+  old_cost = libp_neighbour_parent_cost(n, 0);
+  libp_link_metric_update_rx(&n->lm, seqno);
+  n->last_heard = clock_seconds();
+  n->last_estimated = n->last_heard;
+  return neighbour_changed(n, old_cost);
 }
-void libp_neighbour_tx_fail(struct libp_neighbour *n, uint16_t num_tx)
+uint16_t libp_neighbour_tx_fail(struct libp_neighbour *n, uint16_t num_tx)
 {
+  uint16_t old_cost;
+
 if(n == NULL) {
-    return;
+    return 0;
   }
+  old_cost = libp_neighbour_parent_cost(n, 0);
   libp_link_metric_update_tx_fail(&n->lm, num_tx);
-  n->lm_age = 0;
-  n->age = 0;
+  n->last_heard = clock_seconds();
+  n->last_estimated = n->last_heard;
+  return neighbour_changed(n, old_cost);
 }
-void libp_neighbour_set_congested(struct libp_neighbour *n)
+uint16_t libp_neighbour_set_congested(struct libp_neighbour *n)
 {
-    if(n == NULL) {
+  return congestion_add(n, CONGESTED_STEP);
+}
+uint16_t libp_neighbour_set_dropped(struct libp_neighbour *n)
+{
+  return congestion_add(n, DROPPED_STEP);
+}
+void libp_neighbour_update_rtt(struct libp_neighbour *n, clock_time_t rtt)
+{
+  int16_t delta;
+
+  if(n == NULL) {
     return;
   }
-  timer_set(&n->congested_timer, EXPECTED_CONGESTION_DURATION);
+  if(rtt > MAX_RTT_SAMPLE) {
+    rtt = MAX_RTT_SAMPLE;
+  } else if(rtt == 0) {
+    rtt = 1;
+  }
+
+  if(n->srtt == 0) {
+    /* First sample. */
+    n->srtt = rtt << RTT_SHIFT;
+    n->rttvar = (rtt << RTTVAR_SHIFT) / 2;
+  } else {
+    delta = rtt - (n->srtt >> RTT_SHIFT);
+    n->srtt += delta;
+    if(delta < 0) {
+      delta = -delta;
+    }
+    n->rttvar += delta - (n->rttvar >> RTTVAR_SHIFT);
+  }
+  PRINTF("libp_neighbour_update_rtt: %d.%d rtt %u srtt %u rttvar %u\n",
+         n->addr.u8[0], n->addr.u8[1], rtt,
+         n->srtt >> RTT_SHIFT, n->rttvar >> RTTVAR_SHIFT);
 }
-int libp_neighbour_is_congested(struct libp_neighbour *n)
+uint16_t libp_neighbour_update_children(struct libp_neighbour *n, uint8_t children)
 {
-    if(n == NULL) {
+  uint16_t old_cost;
+
+  if(n == NULL) {
     return 0;
   }
+  old_cost = libp_neighbour_parent_cost(n, 0);
+  libp_link_metric_update_children(&n->lm, children);
+  return neighbour_changed(n, old_cost);
+}
+clock_time_t libp_neighbour_rexmit_timeout(struct libp_neighbour *n)
+{
+  if(n == NULL || n->srtt == 0) {
+    return 0;
+  }
+  /* The timeout is the smoothed round-trip time plus four times the
+     mean deviation. The deviation is already scaled by four. */
+  return (n->srtt >> RTT_SHIFT) + n->rttvar;
+}
+int libp_neighbour_is_congested(struct libp_neighbour *n)
+{
+  return libp_neighbour_congestion(n) != 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * The congestion score of n now, between 0 and 255.
+ */
+uint8_t libp_neighbour_congestion(struct libp_neighbour *n)
+{
+  uint16_t now, elapsed;
 
-  if(timer_expired(&n->congested_timer)) {
+  if(n == NULL) {
     return 0;
-  } else {
-    return 1;
   }
+  now = clock_seconds();
+  congestion_decay(n, now);
+  /* Interpolate towards the next halving. */
+  elapsed = now - n->congestion_time;
+  return n->congestion -
+    ((uint16_t)(n->congestion / 2) * elapsed) / CONGESTION_HALF_LIFE;
 }
 uint16_t libp_neighbour_link_metric(struct libp_neighbour *n)
 {
     if(n == NULL) {
     return 0;
   }
-  if(libp_neighbour_is_congested(n)) {
-    /*    printf("Congested %d.%d, sould return %d, returning %d\n",
-           n->addr.u8[0], n->addr.u8[1],
-           collect_link_estimate(&n->le),
-           collect_link_estimate(&n->le) + CONGESTION_PENALTY);*/
-    return libp_link_metric(&n->lm) + CONGESTION_PENALTY;
-  } else {
-    return libp_link_metric(&n->lm);
-  }
+  return libp_link_metric(&n->lm) +
+    ((uint32_t)libp_neighbour_congestion(n) * CONGESTION_PENALTY) / 255;
 }
 
 
@@ -375,3 +734,25 @@ uint16_t libp_neighbour_rtmetric(struct libp_neighbour *n)
 
   return n->rtmetric;
 }
+/*---------------------------------------------------------------------------*/
+/**
+ * The cost of using n as parent. If is_child is set, we are already
+ * one of n's children and our own share of its load is not counted.
+ */
+uint16_t libp_neighbour_parent_cost(struct libp_neighbour *n, int is_child)
+{
+  uint32_t children, cost;
+
+  if(n == NULL) {
+    return 0;
+  }
+
+  children = libp_link_metric_children(&n->lm);
+  if(is_child) {
+    children = children > LIBP_LINK_METRIC_UNIT ?
+      children - LIBP_LINK_METRIC_UNIT : 0;
+  }
+  cost = (uint32_t)n->rtmetric + libp_neighbour_link_metric(n) +
+    (children * CHILD_WEIGHT) / LIBP_LINK_METRIC_UNIT;
+  return cost > 0xffff ? 0xffff : cost;
+}
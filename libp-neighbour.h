@@ -11,52 +11,112 @@
 #include "net/rime/rimeaddr.h"
 #include "libp-link-metric.h"
 #include "lib/list.h"
+#include "lib/memb.h"
 
+/* The number of neighbours in the default neighbour pool. Connections
+   that bring their own pools size them with LIBP_POOLS(). */
+#ifdef LIBP_NEIGHBOUR_CONF_MAX_LIBP_NEIGHBOURS
+#define MAX_LIBP_NEIGHBOURS LIBP_NEIGHBOUR_CONF_MAX_LIBP_NEIGHBOURS
+#else /* LIBP_NEIGHBOUR_CONF_MAX_LIBP_NEIGHBOURS */
+#define MAX_LIBP_NEIGHBOURS 8
+#endif /* LIBP_NEIGHBOUR_CONF_MAX_LIBP_NEIGHBOURS */
+
+/* The number of backup parents the list ranks behind the best
+   neighbour. */
+#ifdef LIBP_NEIGHBOUR_CONF_BACKUPS
+#define LIBP_NEIGHBOUR_BACKUPS LIBP_NEIGHBOUR_CONF_BACKUPS
+#else /* LIBP_NEIGHBOUR_CONF_BACKUPS */
+#define LIBP_NEIGHBOUR_BACKUPS 2
+#endif /* LIBP_NEIGHBOUR_CONF_BACKUPS */
+
+struct libp_neighbour;
+
+/* The list caches its best neighbour and the neighbour last looked up.
+   The best neighbour is recomputed only after a neighbour whose metric
+   changed may have displaced it, or at best_expires while a congestion
+   penalty that took part in the choice is decaying. Neighbours are aged lazily:
+   next_expiry is the earliest time, in seconds, at which a neighbour
+   or its link estimate may have become too old, and the list is only
+   walked once that time has passed. The backup parents are ranked
+   only when they are asked for, and only among the feasible
+   neighbours, those with an rtmetric below feasible_rtmetric, leaving
+   out backups_parent. */
 struct libp_neighbour_list {
   LIST_STRUCT(list);
-  struct ctimer periodic;
+  struct memb *memb;
+  unsigned long next_expiry;
+  struct libp_neighbour *best, *last_found;
+  struct libp_neighbour *backups[LIBP_NEIGHBOUR_BACKUPS];
+  struct libp_neighbour *backups_parent;
+  clock_time_t best_expires;
+  uint16_t best_cost;
+  uint16_t feasible_rtmetric;
+  uint8_t best_valid, best_has_expiry;
+  uint8_t backups_valid;
 };
 
 struct libp_neighbour {
   struct libp_neighbour *next;
+  struct libp_neighbour_list *list;
   rimeaddr_t addr;
   uint16_t rtmetric;
-  uint16_t age;
-  uint16_t lm_age;
+  /* When we last heard from the neighbour and last got a link
+     estimate for it, from clock_seconds(). */
+  unsigned long last_heard, last_estimated;
   uint16_t penalty;
+  uint16_t srtt, rttvar;
   struct libp_link_metric lm;
-  struct timer congested_timer;
+  /* The congestion score, which halves every half-life, and the time
+     in seconds up to which it has been decayed. */
+  uint16_t congestion_time;
+  uint8_t congestion;
 };
 
-void libp_neighbour_init(void);
-
 list_t libp_neighbour_list(struct libp_neighbour_list *neighbor_list);
 
-void libp_neighbour_list_new(struct libp_neighbour_list *neighbor_list);
+void libp_neighbour_list_new(struct libp_neighbour_list *neighbor_list,
+                             struct memb *memb);
 
 int libp_neighbour_list_add(struct libp_neighbour_list *neighbor_list,
-                              const rimeaddr_t *addr, uint16_t rtmetric);
+                              const rimeaddr_t *addr, uint16_t rtmetric,
+                              const rimeaddr_t *parent);
 void libp_neighbour_list_remove(struct libp_neighbour_list *neighbor_list,
                                   const rimeaddr_t *addr);
 struct libp_neighbour *libp_neighbour_list_find(struct libp_neighbour_list *neighbor_list,
                                                const rimeaddr_t *addr);
 struct libp_neighbour *libp_neighbour_list_best(struct libp_neighbour_list *neighbor_list);
+struct libp_neighbour *libp_neighbour_list_backup(struct libp_neighbour_list *neighbor_list,
+                                                  struct libp_neighbour *parent,
+                                                  int rank);
+void libp_neighbour_list_set_feasible(struct libp_neighbour_list *neighbor_list,
+                                      uint16_t rtmetric);
 int libp_neighbour_list_num(struct libp_neighbour_list *neighbor_list);
 struct libp_neighbour *libp_neighbour_list_get(struct libp_neighbour_list *neighbor_list, int num);
 void libp_neighbour_list_purge(struct libp_neighbour_list *neighbor_list);
 
-void libp_neighbour_update_rtmetric(struct libp_neighbour *n,
+/* The functions that update a neighbour return how much its parent
+   cost changed, or LIBP_NEIGHBOUR_BEST_CHANGED if the update may have
+   changed which neighbour is the best one. */
+#define LIBP_NEIGHBOUR_BEST_CHANGED 0xffff
 
-                                      uint16_t rtmetric);
-void libp_neighbour_tx(struct libp_neighbour *n, uint16_t num_tx);
-void libp_neighbour_rx(struct libp_neighbour *n);
-void libp_neighbour_tx_fail(struct libp_neighbour *n, uint16_t num_tx);
-void libp_neighbour_set_congested(struct libp_neighbour *n);
+uint16_t libp_neighbour_update_rtmetric(struct libp_neighbour *n,
+                                        uint16_t rtmetric);
+uint16_t libp_neighbour_tx(struct libp_neighbour *n, uint16_t num_tx);
+uint16_t libp_neighbour_rx(struct libp_neighbour *n, uint8_t seqno);
+uint16_t libp_neighbour_tx_fail(struct libp_neighbour *n, uint16_t num_tx);
+uint16_t libp_neighbour_set_congested(struct libp_neighbour *n);
+uint16_t libp_neighbour_set_dropped(struct libp_neighbour *n);
+void libp_neighbour_update_rtt(struct libp_neighbour *n, clock_time_t rtt);
+clock_time_t libp_neighbour_rexmit_timeout(struct libp_neighbour *n);
+uint16_t libp_neighbour_update_children(struct libp_neighbour *n,
+                                        uint8_t children);
 int libp_neighbour_is_congested(struct libp_neighbour *n);
+uint8_t libp_neighbour_congestion(struct libp_neighbour *n);
 
 
 uint16_t libp_neighbour_link_metric(struct libp_neighbour *n);
 uint16_t libp_neighbour_rtmetric_link_metric(struct libp_neighbour *n);
 uint16_t libp_neighbour_rtmetric(struct libp_neighbour *n);
+uint16_t libp_neighbour_parent_cost(struct libp_neighbour *n, int is_child);
 
 #endif
@@ -34,18 +34,39 @@
 #define ACK_FLAGS_CONGESTED             0x80
 #define ACK_FLAGS_DROPPED               0x40
 #define ACK_FLAGS_LIFETIME_EXCEEDED     0x20
-#define ACK_FLAGS_PARENT_CHOSEN         0xb
-#define ACK_FLAGS_PARENT_REMOVED        0xa
 #define ACK_FLAGS_RTMETRIC_NEEDS_UPDATE 0x10
+#define ACK_FLAGS_PARENT_CHOSEN         0x08
+#define ACK_FLAGS_PARENT_REMOVED        0x04
 
 #define SEC_FLAGS_NODE_IGNORE           0x80
 
-
-/* The recent_packets list holds the sequence number, the originator,
-   and the connection for packets that have been recently
-   forwarded. This list is maintained to avoid forwarding duplicate
-   packets. */
-#define NUM_RECENT_PACKETS 16
+#define DATA_FLAGS_AGGREGATE            0x80
+/* The packet has been sent as anycast and may have been taken by more
+   than one candidate. It keeps its identity all the way to the sink,
+   so that the copies can be told apart from other packets wherever
+   they meet. */
+#define DATA_FLAGS_ANYCAST              0x02
+
+
+/* The seqno table holds, for every originator that we have recently
+   received packets from, a window of the sequence numbers that we
+   have seen. The table is maintained to avoid forwarding duplicate
+   packets. It is a hash table keyed on the originator, and each
+   lookup examines at most SEQNO_TABLE_PROBES entries. When the table
+   is full, the least recently used of the probed entries is
+   replaced. Every entry takes about ten bytes, so
+   LIBP_CONF_SEQNO_TABLE_SIZE sets the memory budget of the default
+   pools; connections with their own pools size their table with
+   LIBP_POOLS(). */
+#ifdef LIBP_CONF_SEQNO_TABLE_SIZE
+#define SEQNO_TABLE_SIZE LIBP_CONF_SEQNO_TABLE_SIZE
+#else /* LIBP_CONF_SEQNO_TABLE_SIZE */
+#define SEQNO_TABLE_SIZE 16
+#endif /* LIBP_CONF_SEQNO_TABLE_SIZE */
+
+#define SEQNO_TABLE_PROBES 4
+#define SEQNO_WINDOW       32
+#define SEQNO_HALF         ((1 << COLLECT_PACKET_ID_BITS) / 2)
 
 #define MAX_HOPLIM 15
 
@@ -62,8 +83,10 @@
    increased for every new network layer retransmission. The
    FORWARD_PACKET_LIFETIME is the maximum time a packet is held in the
    forwarding queue before it is removed. The MAX_SENDING_QUEUE
-   specifies the maximum length of the output queue. If the queue is
-   full, incoming packets are dropped instead of being forwarded. */
+   specifies the maximum length of the output queue of the default
+   pools; connections with their own pools get the length they were
+   given. If the queue is full, incoming packets are dropped instead
+   of being forwarded. */
 
 #define SIGNIFICANT_RTMETRIC_PARENT_CHANGE (LIBP_LINK_METRIC_UNIT +  \
                                             LIBP_LINK_METRIC_UNIT / 2)
@@ -71,17 +94,144 @@
 #define MAX_MAC_REXMITS            2
 #define MAX_ACK_MAC_REXMITS        5
 #define REXMIT_TIME                (CLOCK_SECOND * 32 / NETSTACK_RDC_CHANNEL_CHECK_RATE)
+#define MIN_REXMIT_TIME            (REXMIT_TIME / 4)
+#define MAX_REXMIT_TIME            (REXMIT_TIME * 8)
 #define FORWARD_PACKET_LIFETIME_BASE    REXMIT_TIME * 2
 #define MAX_SENDING_QUEUE          3 * QUEUEBUF_NUM / 4
 #define MIN_AVAILABLE_QUEUE_ENTRIES 4
+
+/* The number of packets the send queue of a connection can hold, and
+   how many of those may be used for forwarded packets, so that there
+   always are entries left for packets originated by this node. */
+#define QUEUE_SIZE(c)              ((c)->send_queue.memb->num)
+#define FORWARD_QUEUE_SIZE(c)      (QUEUE_SIZE(c) > 2 * MIN_AVAILABLE_QUEUE_ENTRIES ? \
+                                    QUEUE_SIZE(c) - MIN_AVAILABLE_QUEUE_ENTRIES : \
+                                    QUEUE_SIZE(c) / 2)
 #define KEEPALIVE_REXMITS          8
 #define MAX_REXMITS                31
 
-#define PROACTIVE_PROBING_INTERVAL (random_rand() % CLOCK_SECOND * 60)
-#define PROACTIVE_PROBING_REXMITS  15
+/* When idle, we probe a neighbor that may become our parent or a
+   backup parent about every PROACTIVE_PROBING_INTERVAL, but spend no
+   more than PROACTIVE_PROBING_BUDGET transmissions an hour on probes.
+   A probe stays with the neighbor it probes and is given up after
+   PROACTIVE_PROBING_REXMITS transmissions. While the send queue is
+   busy the interval doubles, up to PROACTIVE_PROBING_MAX_BACKOFF
+   times. A neighbor whose estimate is younger than
+   PROACTIVE_PROBING_MIN_AGE seconds, or that could not come within
+   PROACTIVE_PROBING_MARGIN of our parent even over a perfect link, is
+   not probed. */
+#ifdef LIBP_CONF_PROACTIVE_PROBING_INTERVAL
+#define PROACTIVE_PROBING_INTERVAL LIBP_CONF_PROACTIVE_PROBING_INTERVAL
+#else /* LIBP_CONF_PROACTIVE_PROBING_INTERVAL */
+#define PROACTIVE_PROBING_INTERVAL (CLOCK_SECOND * 60)
+#endif /* LIBP_CONF_PROACTIVE_PROBING_INTERVAL */
+#ifdef LIBP_CONF_PROACTIVE_PROBING_BUDGET
+#define PROACTIVE_PROBING_BUDGET LIBP_CONF_PROACTIVE_PROBING_BUDGET
+#else /* LIBP_CONF_PROACTIVE_PROBING_BUDGET */
+#define PROACTIVE_PROBING_BUDGET   60
+#endif /* LIBP_CONF_PROACTIVE_PROBING_BUDGET */
+#define PROACTIVE_PROBING_MAX_BACKOFF 4
+#define PROACTIVE_PROBING_MIN_AGE  120
+#define PROACTIVE_PROBING_MARGIN   (2 * SIGNIFICANT_RTMETRIC_PARENT_CHANGE)
+#define PROACTIVE_PROBING_REXMITS  3
+
+/* Packets that are queued behind the send window are packed into a
+   single frame, with one header and one ACK, as long as the data
+   header and the records stay within AGGREGATION_MAXLEN bytes. The
+   default fits an 802.15.4 frame of 127 bytes: it leaves room for the
+   frame check sequence, a MAC header with long addresses, the Rime
+   headers and the anycast header. Platforms with larger radio frames
+   may raise it with LIBP_CONF_AGGREGATION_MAXLEN, up to
+   PACKETBUF_SIZE. */
+#ifdef LIBP_CONF_AGGREGATION
+#define AGGREGATION LIBP_CONF_AGGREGATION
+#else /* LIBP_CONF_AGGREGATION */
+#define AGGREGATION 1
+#endif /* LIBP_CONF_AGGREGATION */
+
+#ifdef LIBP_CONF_AGGREGATION_MAXLEN
+#define AGGREGATION_MAXLEN LIBP_CONF_AGGREGATION_MAXLEN
+#else /* LIBP_CONF_AGGREGATION_MAXLEN */
+#define AGGREGATION_MAXLEN 80
+#endif /* LIBP_CONF_AGGREGATION_MAXLEN */
+#if AGGREGATION_MAXLEN > PACKETBUF_SIZE
+#error "LIBP_CONF_AGGREGATION_MAXLEN must not exceed PACKETBUF_SIZE"
+#endif
+
+/* A child that has not sent us a packet for CHILD_LIFETIME seconds is
+   no longer counted. */
+#ifdef LIBP_CONF_CHILD_LIFETIME
+#define CHILD_LIFETIME LIBP_CONF_CHILD_LIFETIME
+#else /* LIBP_CONF_CHILD_LIFETIME */
+#define CHILD_LIFETIME 600
+#endif /* LIBP_CONF_CHILD_LIFETIME */
+
+/* Sources are throttled with a token bucket while the path to the
+   sink is congested. The bucket holds TOKEN_BUCKET_DEPTH tokens and
+   gains one every TOKEN_INTERVAL times the congestion level. The
+   congestion level our parent advertised is trusted for
+   CONGESTION_LEVEL_LIFETIME. */
+#ifdef LIBP_CONF_TOKEN_BUCKET_DEPTH
+#define TOKEN_BUCKET_DEPTH LIBP_CONF_TOKEN_BUCKET_DEPTH
+#else /* LIBP_CONF_TOKEN_BUCKET_DEPTH */
+#define TOKEN_BUCKET_DEPTH 4
+#endif /* LIBP_CONF_TOKEN_BUCKET_DEPTH */
+
+#ifdef LIBP_CONF_TOKEN_INTERVAL
+#define TOKEN_INTERVAL LIBP_CONF_TOKEN_INTERVAL
+#else /* LIBP_CONF_TOKEN_INTERVAL */
+#define TOKEN_INTERVAL (CLOCK_SECOND * 2)
+#endif /* LIBP_CONF_TOKEN_INTERVAL */
+
+#define CONGESTION_LEVEL_LIFETIME (CLOCK_SECOND * 60)
+
+/* The route is recomputed when the parent cost of our parent or of the
+   best candidate has changed by ROUTE_UPDATE_THRESHOLD in total since
+   the last recomputation, or when the best candidate may have changed.
+   Our advertised rtmetric is updated when it has moved by at least as
+   much. A threshold of 0 recomputes on every change. */
+#ifdef LIBP_CONF_ROUTE_UPDATE_THRESHOLD
+#define ROUTE_UPDATE_THRESHOLD LIBP_CONF_ROUTE_UPDATE_THRESHOLD
+#else /* LIBP_CONF_ROUTE_UPDATE_THRESHOLD */
+#define ROUTE_UPDATE_THRESHOLD (LIBP_LINK_METRIC_UNIT / 2)
+#endif /* LIBP_CONF_ROUTE_UPDATE_THRESHOLD */
+
+/* A packet whose transmission rounds to a neighbour have failed
+   FAILOVER_FAILURES times in a row is sent to the next of the ranked
+   backup parents, within what is left of its retransmission budget. */
+#ifdef LIBP_CONF_FAILOVER_FAILURES
+#define FAILOVER_FAILURES LIBP_CONF_FAILOVER_FAILURES
+#else /* LIBP_CONF_FAILOVER_FAILURES */
+#define FAILOVER_FAILURES 2
+#endif /* LIBP_CONF_FAILOVER_FAILURES */
+
+/* In opportunistic mode a data packet names up to ANYCAST_CANDIDATES
+   candidates: the parent followed by the backup parents. */
+#ifdef LIBP_CONF_ANYCAST_CANDIDATES
+#define ANYCAST_CANDIDATES LIBP_CONF_ANYCAST_CANDIDATES
+#else /* LIBP_CONF_ANYCAST_CANDIDATES */
+#define ANYCAST_CANDIDATES (1 + LIBP_NEIGHBOUR_BACKUPS)
+#endif /* LIBP_CONF_ANYCAST_CANDIDATES */
 
 #define REBROADCAST_TIME 10
-#define BEACONING_PERIOD 30
+
+/* Beacons are scheduled with a Trickle timer (RFC 6206). The interval
+   starts at the beacon period, doubles at most BEACON_DOUBLINGS times
+   while the neighbourhood is consistent, and a beacon is suppressed
+   when BEACON_REDUNDANCY consistent beacons have already been heard in
+   the current interval. Non-sinks use REBROADCAST_TIME seconds as
+   their beacon period unless told otherwise. */
+#ifdef LIBP_CONF_BEACON_DOUBLINGS
+#define BEACON_DOUBLINGS LIBP_CONF_BEACON_DOUBLINGS
+#else /* LIBP_CONF_BEACON_DOUBLINGS */
+#define BEACON_DOUBLINGS 6
+#endif /* LIBP_CONF_BEACON_DOUBLINGS */
+
+#ifdef LIBP_CONF_BEACON_REDUNDANCY
+#define BEACON_REDUNDANCY LIBP_CONF_BEACON_REDUNDANCY
+#else /* LIBP_CONF_BEACON_REDUNDANCY */
+#define BEACON_REDUNDANCY 2
+#endif /* LIBP_CONF_BEACON_REDUNDANCY */
 /* Debug definition: draw routing tree in Cooja. */
 #define DRAW_TREE 0
 #define DEBUG 0
@@ -92,19 +242,26 @@
 #define PRINTF(...)
 #endif
 
+#if LIBP_WINDOW_SIZE < 1 || LIBP_WINDOW_SIZE > (1 << COLLECT_PACKET_ID_BITS) / 2
+#error LIBP_WINDOW_SIZE must be between 1 and half the packet id space
+#endif
+
 /* Forward declarations. */
 static void send_queued_packet(struct libp_conn *c);
 static void retransmit_callback(void *ptr);
 static void retransmit_not_sent_callback(void *ptr);
+static void proactive_probing_callback(void *ptr);
 static void set_beacon_timer(struct libp_conn *c);
+static void reset_beacon_timer(struct libp_conn *c);
 static void bump_advertisement(struct libp_conn *c);
 static void update_rtmetric(struct libp_conn *c);
+static void route_event(struct libp_conn *c, struct libp_neighbour *n,
+                        uint32_t delta);
 /*static void update_parent(struct libp_conn *c);
 static void rtmetric_compute(struct libp_conn *c);*/
 
-static struct libp_conn *l;
-
-MEMB(send_queue_memb, struct packetqueue_item, MAX_SENDING_QUEUE);
+LIBP_POOLS(default_pools, MAX_SENDING_QUEUE, SEQNO_TABLE_SIZE,
+           MAX_LIBP_NEIGHBOURS);
 
 static const struct packetbuf_attrlist attributes[] =
   {
@@ -112,52 +269,262 @@ static const struct packetbuf_attrlist attributes[] =
     PACKETBUF_ATTR_LAST
   };
 
-  struct recent_packet {
-  struct libp_conn *conn;
-  rimeaddr_t originator;
-  uint8_t eseqno;
-};
+static const struct packetbuf_attrlist anycast_attributes[] =
+  {
+    COLLECT_ATTRIBUTES
+    BROADCAST_ATTRIBUTES
+    PACKETBUF_ATTR_LAST
+  };
 
-static struct recent_packet recent_packets[NUM_RECENT_PACKETS];
-static uint8_t recent_packet_ptr;
+static uint8_t seqno_stamp;
 
+/* The deadline field holds the time left before the packet's
+   deadline, in clock ticks, at the moment the packet was sent, or 0
+   if the packet has no deadline. */
 struct data_msg_hdr {
-    uint8_t flags, dummy;
+    uint8_t flags, tclass;
     uint16_t rtmetric;
+    uint16_t deadline;
+};
+
+/* An aggregated frame has DATA_FLAGS_AGGREGATE set in its header and
+   carries a sequence of records, each one an original packet with the
+   attributes needed to hand it to the application at the sink. The
+   hops field holds the number of hops the packet had travelled when
+   it was aggregated; the hop count of the frame itself is added at
+   the sink. */
+struct aggregate_record_hdr {
+    rimeaddr_t originator;
+    uint8_t eseqno;
+    uint8_t hops;
+    uint8_t len;
+};
+
+static uint8_t aggregate_buf[PACKETBUF_SIZE];
+
+/* Data packets sent opportunistically go out on the anycast channel
+   with this header in front of the data header. A candidate takes the
+   packet only if it is named here, and a candidate other than the
+   first only if its rtmetric is lower than the sender's. */
+struct anycast_hdr {
+    uint8_t num;
+    rimeaddr_t candidates[ANYCAST_CANDIDATES];
 };
 
+/* ACKs and beacons carry the number of children the sender currently
+   forwards for, which its neighbors use when choosing a parent, and
+   the congestion level of the sender's path to the sink. */
 struct ack_msg {
-    uint8_t flags, dummy;
+    uint8_t flags, children;
     uint16_t rtmetric;
+    uint8_t congestion;
 };
 
 struct beacon_message {
-    uint8_t flags, dummy;
+    uint8_t flags, children;
     uint16_t rtmetric;
     uint8_t seqno;
+    uint8_t congestion;
 };
 
-/* Statistics structure */
-struct {
-  uint32_t foundroute;
-  uint32_t newparent;
-  uint32_t routelost;
-
-  uint32_t acksent;
-  uint32_t datasent;
-
-  uint32_t datarecv;
-  uint32_t ackrecv;
-  uint32_t badack;
-  uint32_t duprecv;
-
-  uint32_t qdrop;
-  uint32_t rtdrop;
-  uint32_t ttldrop;
-  uint32_t ackdrop;
-  uint32_t timedout;
-} stats;
+/*---------------------------------------------------------------------------*/
+static void
+stats_hist_add(uint16_t *hist, uint32_t value)
+{
+  int b;
+
+  for(b = 0; value > 0 && b < LIBP_STATS_BUCKETS - 1; b++) {
+    value >>= 1;
+  }
+  if(hist[b] < 0xffff) {
+    hist[b]++;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+stats_parent_changed(struct libp_conn *c)
+{
+  unsigned long now = clock_seconds();
+
+  if(c->parent_change_time != 0) {
+    stats_hist_add(c->stats.parent_hist, (now - c->parent_change_time) / 16);
+  }
+  c->parent_change_time = now;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * The congestion level of our path to the sink: the fill level of our
+ * own send queue or the level our parent advertised, whichever is
+ * higher. Like ACK_FLAGS_CONGESTED, our own queue counts as congested
+ * once it is half full.
+ */
+static uint8_t
+congestion_level(struct libp_conn *c)
+{
+  int len, half;
+  uint8_t level;
+
+  len = packetqueue_len(&c->send_queue);
+  half = QUEUE_SIZE(c) / 2;
+  if(len < half) {
+    level = 0;
+  } else {
+    level = 1 + ((len - half) * (LIBP_CONGESTION_LEVELS - 1)) /
+      (QUEUE_SIZE(c) - half + 1);
+  }
+  if(!timer_expired(&c->parent_congestion_timer) &&
+     c->parent_congestion > level) {
+    level = c->parent_congestion;
+  }
+  return level < LIBP_CONGESTION_LEVELS ? level : LIBP_CONGESTION_LEVELS - 1;
+}
+/*---------------------------------------------------------------------------*/
+static void
+set_parent_congestion(struct libp_conn *c, const rimeaddr_t *from,
+                      uint8_t level)
+{
+  if(rimeaddr_cmp(from, &c->parent)) {
+    c->parent_congestion = level;
+    timer_set(&c->parent_congestion_timer, CONGESTION_LEVEL_LIFETIME);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Decide whether a packet of class tclass may be sent now. Returns 0
+ * if so, otherwise the time until the next token arrives.
+ */
+static clock_time_t
+admit_packet(struct libp_conn *c, uint8_t tclass)
+{
+  clock_time_t interval, elapsed;
+  uint8_t level;
+
+  level = congestion_level(c);
+  if(level == 0) {
+    c->tokens = TOKEN_BUCKET_DEPTH;
+    c->token_time = clock_time();
+    return 0;
+  }
+
+  interval = TOKEN_INTERVAL * level;
+  elapsed = clock_time() - c->token_time;
+  if(elapsed >= interval * (TOKEN_BUCKET_DEPTH - c->tokens)) {
+    c->tokens = TOKEN_BUCKET_DEPTH;
+    c->token_time = clock_time();
+  } else {
+    c->tokens += elapsed / interval;
+    c->token_time += (elapsed / interval) * interval;
+  }
+
+  if(tclass == LIBP_CLASS_ALARM) {
+    return 0;
+  }
+  if(c->tokens > 0) {
+    c->tokens--;
+    return 0;
+  }
+  elapsed = clock_time() - c->token_time;
+  return elapsed < interval ? interval - elapsed : 1;
+}
 /*-----------------------Call backs---------------------------- */
+/* A child sets ACK_FLAGS_PARENT_CHOSEN in the header of its data
+   packets until its parent has echoed the flag in an ACK, and sends
+   a header-only packet with ACK_FLAGS_PARENT_REMOVED to its old parent
+   when it switches. A parent echoes ACK_FLAGS_PARENT_CHOSEN to every
+   registered child, so a child that has been forgotten registers
+   again. */
+static struct libp_child *
+child_find(struct libp_conn *c, const rimeaddr_t *addr)
+{
+  int i;
+
+  for(i = 0; i < LIBP_MAX_CHILDREN; i++) {
+    if(rimeaddr_cmp(&c->children[i].addr, addr)) {
+      return &c->children[i];
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static void
+child_expire(struct libp_conn *c)
+{
+  uint16_t now = clock_seconds();
+  int i;
+
+  for(i = 0; i < LIBP_MAX_CHILDREN; i++) {
+    if(!rimeaddr_cmp(&c->children[i].addr, &rimeaddr_null) &&
+       (uint16_t)(now - c->children[i].last_heard) > CHILD_LIFETIME) {
+      PRINTF("child_expire: %d.%d\n",
+             c->children[i].addr.u8[0], c->children[i].addr.u8[1]);
+      rimeaddr_copy(&c->children[i].addr, &rimeaddr_null);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+child_update(struct libp_conn *c, const rimeaddr_t *addr, uint8_t flags)
+{
+  struct libp_child *child;
+
+  child = child_find(c, addr);
+  if(flags & ACK_FLAGS_PARENT_REMOVED) {
+    if(child != NULL) {
+      PRINTF("child_update: %d.%d removed\n", addr->u8[0], addr->u8[1]);
+      rimeaddr_copy(&child->addr, &rimeaddr_null);
+    }
+    return;
+  }
+  if(child == NULL && (flags & ACK_FLAGS_PARENT_CHOSEN)) {
+    child_expire(c);
+    child = child_find(c, &rimeaddr_null);
+    if(child != NULL) {
+      PRINTF("child_update: %d.%d added\n", addr->u8[0], addr->u8[1]);
+      rimeaddr_copy(&child->addr, addr);
+    }
+  }
+  if(child != NULL) {
+    child->last_heard = clock_seconds();
+  }
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t
+num_children(struct libp_conn *c)
+{
+  uint8_t num = 0;
+  int i;
+
+  child_expire(c);
+  for(i = 0; i < LIBP_MAX_CHILDREN; i++) {
+    if(!rimeaddr_cmp(&c->children[i].addr, &rimeaddr_null)) {
+      num++;
+    }
+  }
+  return num;
+}
+/*---------------------------------------------------------------------------*/
+static void
+send_parent_removed(void *ptr)
+{
+  struct libp_conn *c = ptr;
+  struct data_msg_hdr hdr;
+
+  memset(&hdr, 0, sizeof(struct data_msg_hdr));
+  hdr.flags = ACK_FLAGS_PARENT_REMOVED;
+  hdr.rtmetric = c->rtmetric;
+
+  packetbuf_clear();
+  packetbuf_copyfrom(&hdr, sizeof(struct data_msg_hdr));
+  packetbuf_set_attr(PACKETBUF_ATTR_PACKET_TYPE, PACKETBUF_ATTR_PACKET_TYPE_DATA);
+  packetbuf_set_attr(PACKETBUF_ATTR_RELIABLE, 0);
+  packetbuf_set_attr(PACKETBUF_ATTR_MAX_MAC_TRANSMISSIONS, MAX_MAC_REXMITS);
+  unicast_send(&c->unicast_conn, &c->removed_parent);
+
+  PRINTF("%d.%d: leaving parent %d.%d\n",
+         rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+         c->removed_parent.u8[0], c->removed_parent.u8[1]);
+}
+/*---------------------------------------------------------------------------*/
 
 static void
 send_ack(struct libp_conn *tc, const rimeaddr_t *to, int flags)
@@ -171,6 +538,8 @@ send_ack(struct libp_conn *tc, const rimeaddr_t *to, int flags)
   memset(ack, 0, sizeof(struct ack_msg));
   ack->rtmetric = tc->rtmetric;
   ack->flags = flags;
+  ack->children = num_children(tc);
+  ack->congestion = congestion_level(tc);
 
   packetbuf_set_addr(PACKETBUF_ADDR_RECEIVER, to);
   packetbuf_set_attr(PACKETBUF_ATTR_PACKET_TYPE, PACKETBUF_ATTR_PACKET_TYPE_ACK);
@@ -186,22 +555,96 @@ send_ack(struct libp_conn *tc, const rimeaddr_t *to, int flags)
          packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID));
 
   RIMESTATS_ADD(acktx);
-  stats.acksent++;
+  tc->stats.acksent++;
 }
 /*---------------------------------------------------------------------------*/
 
+/*---------------------------------------------------------------------------*/
+/* The send window holds the packets that are currently outstanding
+   towards our parent. A window slot points to its packet on the send
+   queue; the packet stays on the queue until the slot is released. */
+static struct libp_window_slot *
+window_find(struct libp_conn *c, uint8_t seqno)
+{
+  int i;
+
+  for(i = 0; i < LIBP_WINDOW_SIZE; i++) {
+    if(c->window[i].item != NULL && c->window[i].seqno == seqno) {
+      return &c->window[i];
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static struct libp_window_slot *
+window_holding(struct libp_conn *c, struct packetqueue_item *i)
+{
+  int k;
+
+  for(k = 0; k < LIBP_WINDOW_SIZE; k++) {
+    if(c->window[k].item == i) {
+      return &c->window[k];
+    }
+  }
+  return NULL;
+}
 /*---------------------------------------------------------------------------*/
 static void
-send_next_packet(struct libp_conn *tc)
+window_clear(struct libp_conn *c)
 {
-  /* Remove the first packet on the queue, the packet that was just sent. */
-  packetqueue_dequeue(&tc->send_queue);
-  tc->seqno = (tc->seqno + 1) % (1 << COLLECT_PACKET_ID_BITS);
+  int i;
 
-  /* Cancel retransmission timer. */
-  ctimer_stop(&tc->retransmission_timer);
-  tc->sending = 0;
-  tc->transmissions = 0;
+  for(i = 0; i < LIBP_WINDOW_SIZE; i++) {
+    ctimer_stop(&c->window[i].retransmission_timer);
+    c->window[i].item = NULL;
+  }
+  c->sending = 0;
+}
+/*---------------------------------------------------------------------------*/
+static void
+remove_queued_packet(struct libp_conn *c, struct packetqueue_item *i)
+{
+  ctimer_stop(&i->lifetimer);
+  queuebuf_free(i->buf);
+  list_remove(*c->send_queue.list, i);
+  memb_free(c->send_queue.memb, i);
+}
+/*---------------------------------------------------------------------------*/
+/* Give the packet in a slot back to the send queue without sending it,
+   for instance when there is no neighbor to send it to. The packet
+   regains its queue lifetime and will be picked up again by
+   send_queued_packet(). A packet with a deadline only gets the time
+   left before the deadline, and is dropped if there is none left. */
+static void
+window_return(struct libp_window_slot *s)
+{
+  struct ctimer *t = &s->item->lifetimer;
+
+  ctimer_stop(&s->retransmission_timer);
+  if(!s->has_deadline) {
+    ctimer_restart(t);
+  } else if(CLOCK_LT(clock_time(), s->deadline)) {
+    ctimer_set(t, s->deadline - clock_time(), t->f, t->ptr);
+  } else {
+    PRINTF("%d.%d: packet %d missed its deadline: packet dropped\n",
+           rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], s->seqno);
+    remove_queued_packet(s->c, s->item);
+    s->c->stats.deadlinedrop++;
+  }
+  s->item = NULL;
+  s->c->sending--;
+}
+/*---------------------------------------------------------------------------*/
+static void
+send_next_packet(struct libp_window_slot *s)
+{
+  struct libp_conn *tc = s->c;
+
+  /* Remove the packet that was just sent from the queue. */
+  ctimer_stop(&s->retransmission_timer);
+  remove_queued_packet(tc, s->item);
+  s->item = NULL;
+  tc->sending--;
 
   PRINTF("sending next packet, seqno %d, queue len %d\n",
          tc->seqno, packetqueue_len(&tc->send_queue));
@@ -211,28 +654,341 @@ send_next_packet(struct libp_conn *tc)
 }
 /*---------------------------------------------------------------------------*/
 
+/**
+ * Return the network layer retransmission timeout for the neighbor
+ * n, derived from the round-trip times measured from its ACKs and
+ * bounded by MIN_REXMIT_TIME and MAX_REXMIT_TIME, or 0 if we have not
+ * measured n yet.
+ */
+static clock_time_t
+rexmit_timeout(struct libp_neighbour *n)
+{
+  clock_time_t rto;
+
+  rto = libp_neighbour_rexmit_timeout(n);
+  if(rto == 0) {
+    return 0;
+  }
+  if(rto < MIN_REXMIT_TIME) {
+    return MIN_REXMIT_TIME;
+  }
+  if(rto > MAX_REXMIT_TIME) {
+    return MAX_REXMIT_TIME;
+  }
+  return rto;
+}
+/*---------------------------------------------------------------------------*/
+/* The order in which queued packets are sent: by traffic class, then
+   packets with a deadline by earliest deadline, then in arrival
+   order. */
+struct queue_key {
+  uint8_t tclass;
+  uint8_t has_deadline;
+  clock_time_t deadline;
+};
+
+static void
+queue_key(struct packetqueue_item *i, struct queue_key *k)
+{
+  struct data_msg_hdr hdr;
+
+  memcpy(&hdr, queuebuf_dataptr(i->buf), sizeof(struct data_msg_hdr));
+  k->tclass = hdr.tclass;
+  k->has_deadline = hdr.deadline != 0;
+  /* A queued packet with a deadline has the deadline as its queue
+     lifetime, so the lifetime timer tells when the deadline is. */
+  k->deadline = k->has_deadline ?
+    etimer_expiration_time(&i->lifetimer.etimer) : 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+queue_key_before(const struct queue_key *a, const struct queue_key *b)
+{
+  if(a->tclass != b->tclass) {
+    return a->tclass > b->tclass;
+  }
+  if(a->has_deadline != b->has_deadline) {
+    return a->has_deadline;
+  }
+  return a->has_deadline && CLOCK_LT(a->deadline, b->deadline);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Remove the last queued packet, that has not yet been transmitted,
+ * with a traffic class lower than tclass. Returns non-zero if a
+ * packet was removed.
+ */
+static int
+make_room(struct libp_conn *c, uint8_t tclass)
+{
+  struct packetqueue_item *i, *victim;
+  struct queue_key k;
+
+  victim = NULL;
+  for(i = packetqueue_first(&c->send_queue); i != NULL;
+      i = list_item_next(i)) {
+    queue_key(i, &k);
+    if(window_holding(c, i) == NULL && k.tclass < tclass) {
+      victim = i;
+    }
+  }
+  if(victim != NULL) {
+    PRINTF("%d.%d: dropping queued packet to make room for class %d\n",
+           rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], tclass);
+    remove_queued_packet(c, victim);
+    c->stats.qdrop++;
+    return 1;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Put the packet in the packetbuf, with the header hdr, on the send
+ * queue at the position given by its traffic class and deadline. A
+ * packet with a deadline gets the deadline as its queue lifetime, so
+ * that it is dropped as soon as the deadline has passed. Returns the
+ * queue item, or NULL if the packet could not be queued.
+ */
+static struct packetqueue_item *
+enqueue_packetbuf(struct libp_conn *c, const struct data_msg_hdr *hdr)
+{
+  struct packetqueue_item *i, *prev, *next;
+  struct queue_key k, kn;
+  clock_time_t lifetime;
+
+  if(hdr->deadline != 0) {
+    lifetime = hdr->deadline;
+  } else {
+    lifetime = FORWARD_PACKET_LIFETIME_BASE *
+      packetbuf_attr(PACKETBUF_ATTR_MAX_REXMIT);
+  }
+
+  stats_hist_add(c->stats.queue_hist, packetqueue_len(&c->send_queue));
+  if(!packetqueue_enqueue_packetbuf(&c->send_queue, lifetime, c)) {
+    return NULL;
+  }
+
+  /* The packet was added at the end of the queue. Move it in front of
+     the first packet that is to be sent after it. Packets that are
+     already outstanding keep their place. */
+  for(i = packetqueue_first(&c->send_queue);
+      list_item_next(i) != NULL; i = list_item_next(i));
+  queue_key(i, &k);
+  prev = NULL;
+  for(next = packetqueue_first(&c->send_queue); next != i;
+      next = list_item_next(next)) {
+    queue_key(next, &kn);
+    if(window_holding(c, next) == NULL && queue_key_before(&k, &kn)) {
+      list_remove(*c->send_queue.list, i);
+      list_insert(*c->send_queue.list, prev, i);
+      break;
+    }
+    prev = next;
+  }
+  return i;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t
+allocate_eseqno(struct libp_conn *c)
+{
+  uint8_t eseqno = c->eseqno;
+
+  /* Increase the sequence number for the packet we send out. We
+     employ a trick that allows us to see that a node has been
+     rebooted: if the sequence number wraps to 0, we set it to half of
+     the sequence number space. This allows us to detect reboots,
+     since if a sequence number is less than half of the sequence
+     number space, the data comes from a node that was recently
+     rebooted. */
+  c->eseqno = (c->eseqno + 1) % (1 << COLLECT_PACKET_ID_BITS);
+  if(c->eseqno == 0) {
+    c->eseqno = ((int)(1 << COLLECT_PACKET_ID_BITS)) / 2;
+  }
+  return eseqno;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Append the packet held by the queuebuf q, as aggregate records, to
+ * aggregate_buf at offset len. Returns the new length, or -1 if the
+ * records do not fit in an aggregated frame.
+ */
+static int
+append_aggregate_records(int len, struct queuebuf *q)
+{
+  struct data_msg_hdr hdr;
+  struct aggregate_record_hdr rec;
+  uint8_t *data;
+  uint8_t hops;
+  int datalen, ptr;
+
+  data = queuebuf_dataptr(q);
+  datalen = queuebuf_datalen(q) - sizeof(struct data_msg_hdr);
+  memcpy(&hdr, data, sizeof(struct data_msg_hdr));
+  data += sizeof(struct data_msg_hdr);
+
+  /* The number of hops the packet has travelled so far. */
+  hops = queuebuf_attr(q, PACKETBUF_ATTR_HOPS) - 1;
+
+  /* A packet that may have been forked by an anycast transmission
+     must not disappear into an aggregate. */
+  if(hdr.flags & DATA_FLAGS_ANYCAST) {
+    return -1;
+  }
+
+  if(hdr.flags & DATA_FLAGS_AGGREGATE) {
+    /* The packet already is an aggregate, so we copy its records and
+       add the hops the aggregate has travelled to each of them. */
+    if(len + datalen > AGGREGATION_MAXLEN) {
+      return -1;
+    }
+    memcpy(&aggregate_buf[len], data, datalen);
+    for(ptr = len; ptr + sizeof(struct aggregate_record_hdr) <= len + datalen;
+        ptr += sizeof(struct aggregate_record_hdr) + rec.len) {
+      memcpy(&rec, &aggregate_buf[ptr], sizeof(struct aggregate_record_hdr));
+      rec.hops += hops;
+      memcpy(&aggregate_buf[ptr], &rec, sizeof(struct aggregate_record_hdr));
+    }
+    return len + datalen;
+  }
+
+  if(len + sizeof(struct aggregate_record_hdr) + datalen > AGGREGATION_MAXLEN) {
+    return -1;
+  }
+  rimeaddr_copy(&rec.originator, queuebuf_addr(q, PACKETBUF_ADDR_ESENDER));
+  rec.eseqno = queuebuf_attr(q, PACKETBUF_ATTR_EPACKET_ID);
+  rec.hops = hops;
+  rec.len = datalen;
+  memcpy(&aggregate_buf[len], &rec, sizeof(struct aggregate_record_hdr));
+  len += sizeof(struct aggregate_record_hdr);
+  memcpy(&aggregate_buf[len], data, datalen);
+  return len + datalen;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * This function is called after the packet last has been put on the
+ * send queue. If the packet is waiting behind another packet of the
+ * same traffic class that has not yet been transmitted, the two are
+ * packed into one frame, so that they share one header and one ACK
+ * towards the parent. Packets with a deadline, and packets that were
+ * sent as anycast, are not aggregated.
+ */
+static void
+aggregate_queued_packet(struct libp_conn *c, struct packetqueue_item *last)
+{
+  struct packetqueue_item *prev, *i;
+  struct queuebuf *q;
+  struct data_msg_hdr hdr;
+  struct queue_key kp, kl;
+  uint8_t ttl, max_rexmit;
+  int len;
+
+  if(!AGGREGATION) {
+    return;
+  }
+
+  /* Find the packet in front of the new one. */
+  prev = NULL;
+  for(i = packetqueue_first(&c->send_queue); i != NULL && i != last;
+      i = list_item_next(i)) {
+    prev = i;
+  }
+
+  /* Packets that have already been transmitted must keep their
+     identity, and zero-length packets are probes that should not be
+     delivered. */
+  if(prev == NULL || i == NULL ||
+     window_holding(c, prev) != NULL || window_holding(c, last) != NULL ||
+     queuebuf_datalen(prev->buf) <= sizeof(struct data_msg_hdr) ||
+     queuebuf_datalen(last->buf) <= sizeof(struct data_msg_hdr)) {
+    return;
+  }
+  queue_key(prev, &kp);
+  queue_key(last, &kl);
+  if(kp.tclass != kl.tclass || kp.has_deadline || kl.has_deadline) {
+    return;
+  }
+
+  len = append_aggregate_records(sizeof(struct data_msg_hdr), prev->buf);
+  if(len >= 0) {
+    len = append_aggregate_records(len, last->buf);
+  }
+  if(len < 0) {
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.flags = DATA_FLAGS_AGGREGATE;
+  hdr.tclass = kl.tclass;
+  memcpy(aggregate_buf, &hdr, sizeof(struct data_msg_hdr));
+
+  ttl = queuebuf_attr(prev->buf, PACKETBUF_ATTR_TTL);
+  if(queuebuf_attr(last->buf, PACKETBUF_ATTR_TTL) < ttl) {
+    ttl = queuebuf_attr(last->buf, PACKETBUF_ATTR_TTL);
+  }
+  max_rexmit = queuebuf_attr(prev->buf, PACKETBUF_ATTR_MAX_REXMIT);
+  if(queuebuf_attr(last->buf, PACKETBUF_ATTR_MAX_REXMIT) > max_rexmit) {
+    max_rexmit = queuebuf_attr(last->buf, PACKETBUF_ATTR_MAX_REXMIT);
+  }
+
+  /* The last packet is now part of the aggregate, so we remove it
+     from the queue. This also releases the queuebuf that we need for
+     the aggregated frame. */
+  remove_queued_packet(c, last);
+
+  /* The aggregated frame is a new packet that originates here. */
+  packetbuf_copyfrom(aggregate_buf, len);
+  packetbuf_set_addr(PACKETBUF_ADDR_ESENDER, &rimeaddr_node_addr);
+  packetbuf_set_attr(PACKETBUF_ATTR_EPACKET_ID, allocate_eseqno(c));
+  packetbuf_set_attr(PACKETBUF_ATTR_HOPS, 1);
+  packetbuf_set_attr(PACKETBUF_ATTR_TTL, ttl);
+  packetbuf_set_attr(PACKETBUF_ATTR_MAX_REXMIT, max_rexmit);
+
+  q = queuebuf_new_from_packetbuf();
+  if(q != NULL) {
+    queuebuf_free(prev->buf);
+    prev->buf = q;
+    c->stats.aggregated++;
+    PRINTF("%d.%d: aggregated queued packets, %d bytes\n",
+           rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], len);
+  }
+}
+/*---------------------------------------------------------------------------*/
 static void
 handle_ack(struct libp_conn *tc)
 {
   struct ack_msg msg;
   struct libp_neighbour *n;
+  struct libp_window_slot *s;
+  clock_time_t rto;
+  uint32_t delta;
 
   PRINTF("handle_ack: sender %d.%d current_parent %d.%d, id %d seqno %d\n",
          packetbuf_addr(PACKETBUF_ADDR_SENDER)->u8[0],
          packetbuf_addr(PACKETBUF_ADDR_SENDER)->u8[1],
          tc->current_parent.u8[0], tc->current_parent.u8[1],
          packetbuf_attr(PACKETBUF_ATTR_PACKET_ID), tc->seqno);
-  if(rimeaddr_cmp(packetbuf_addr(PACKETBUF_ADDR_SENDER),
-                  &tc->current_parent) &&
-     packetbuf_attr(PACKETBUF_ATTR_PACKET_ID) == tc->seqno) {
 
-    /*    PRINTF("rtt %d / %d = %d.%02d\n",
-           (int)(clock_time() - tc->send_time),
+  /* Match the ACK to the window slot that holds the packet with the
+     acknowledged packet id. */
+  s = window_find(tc, packetbuf_attr(PACKETBUF_ATTR_PACKET_ID));
+  if(s != NULL && s->anycast &&
+     !rimeaddr_cmp(packetbuf_addr(PACKETBUF_ADDR_SENDER), &s->to) &&
+     libp_neighbour_list_find(&tc->neighbour_list,
+                              packetbuf_addr(PACKETBUF_ADDR_SENDER)) != NULL) {
+    /* A candidate other than the one we addressed took the packet, so
+       the transmissions are credited to it. */
+    rimeaddr_copy(&s->to, packetbuf_addr(PACKETBUF_ADDR_SENDER));
+  }
+  if(s != NULL &&
+     rimeaddr_cmp(packetbuf_addr(PACKETBUF_ADDR_SENDER), &s->to)) {
+
+    PRINTF("rtt %d / %d = %d.%02d\n",
+           (int)(clock_time() - s->send_time),
            (int)CLOCK_SECOND,
-           (int)((clock_time() - tc->send_time) / CLOCK_SECOND),
-           (int)(((100 * (clock_time() - tc->send_time)) / CLOCK_SECOND) % 100));*/
+           (int)((clock_time() - s->send_time) / CLOCK_SECOND),
+           (int)(((100 * (clock_time() - s->send_time)) / CLOCK_SECOND) % 100));
 
-    stats.ackrecv++;
+    tc->stats.ackrecv++;
     memcpy(&msg, packetbuf_dataptr(), sizeof(struct ack_msg));
 
     /* It is possible that we receive an ACK for a packet that we
@@ -241,61 +997,82 @@ handle_ack(struct libp_conn *tc)
        transmission counter may still be zero. If this is the case, we
        play it safe by believing that we have sent MAX_MAC_REXMITS
        transmissions. */
-    if(tc->transmissions == 0) {
-      tc->transmissions = MAX_MAC_REXMITS;
+    if(s->transmissions == 0) {
+      s->transmissions = MAX_MAC_REXMITS;
+    }
+    if(s->to_transmissions == 0) {
+      s->to_transmissions = MAX_MAC_REXMITS;
     }
     PRINTF("Updating link estimate with %d transmissions\n",
-           tc->transmissions);
+           s->to_transmissions);
     n = libp_neighbour_list_find(&tc->neighbour_list,
                                    packetbuf_addr(PACKETBUF_ADDR_SENDER));
 
+    delta = 0;
     if(n != NULL) {
-      libp_neighbour_tx(n, tc->transmissions);
-      libp_neighbour_update_rtmetric(n, msg.rtmetric);
-      update_rtmetric(tc);
+      /* Only packets that were sent once at the network layer give a
+         round-trip time sample, since we cannot tell which of several
+         transmissions an ACK belongs to. */
+      if(!s->retransmitted) {
+        libp_neighbour_update_rtt(n, clock_time() - s->send_time);
+      }
+      delta = libp_neighbour_tx(n, s->to_transmissions);
+      delta += libp_neighbour_update_rtmetric(n, msg.rtmetric);
+      delta += libp_neighbour_update_children(n, msg.children);
+    }
+    set_parent_congestion(tc, &s->to, msg.congestion);
+
+    /* Our parent echoes the parent chosen flag for as long as it
+       counts us as a child. */
+    if(rimeaddr_cmp(&s->to, &tc->parent) &&
+       tc->parent_confirmed != ((msg.flags & ACK_FLAGS_PARENT_CHOSEN) != 0)) {
+      tc->parent_confirmed = !tc->parent_confirmed;
+      delta = LIBP_NEIGHBOUR_BEST_CHANGED;
     }
+    route_event(tc, n, delta);
 
     PRINTF("%d.%d: ACK from %d.%d after %d transmissions, flags %02x, rtmetric %d\n",
            rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
-           tc->current_parent.u8[0], tc->current_parent.u8[1],
-           tc->transmissions,
+           s->to.u8[0], s->to.u8[1],
+           s->transmissions,
            msg.flags,
            msg.rtmetric);
 
     /* The ack contains information about the state of the packet and
        of the node that received it. We do different things depending
        on whether or not the packet was dropped. First, we check if
-       the receiving node was congested. If so, we add a maximum
-       transmission number to its routing metric, which increases the
-       chance that another parent will be chosen. */
+       the receiving node was congested. If so, we raise its
+       congestion score, which adds a decaying penalty to its link
+       metric and increases the chance that another parent will be
+       chosen. */
     if(msg.flags & ACK_FLAGS_CONGESTED) {
       PRINTF("ACK flag indicated parent was congested.\n");
-      if(n != NULL) {
-	libp_neighbour_set_congested(n);
-	libp_neighbour_tx(n, tc->max_rexmits * 2);
-      }
-      update_rtmetric(tc);
+      route_event(tc, n, libp_neighbour_set_congested(n));
     }
     if((msg.flags & ACK_FLAGS_DROPPED) == 0) {
       /* If the packet was successfully received, we send the next packet. */
-      send_next_packet(tc);
+      stats_hist_add(tc->stats.tx_hist, s->transmissions);
+      send_next_packet(s);
     } else {
       /* If the packet was lost due to its lifetime being exceeded,
          there is not much more we can do with the packet, so we send
          the next one instead. */
       if((msg.flags & ACK_FLAGS_LIFETIME_EXCEEDED)) {
-        send_next_packet(tc);
+        send_next_packet(s);
       } else {
         /* If the packet was dropped, but without the node being
            congested or the packets lifetime being exceeded, we
            penalize the parent and try sending the packet again. */
         PRINTF("ACK flag indicated packet was dropped by parent.\n");
-        libp_neighbour_tx(n, tc->max_rexmits);
-        update_rtmetric(tc);
+        route_event(tc, n, libp_neighbour_set_dropped(n));
 
-        ctimer_set(&tc->retransmission_timer,
-                   REXMIT_TIME + (random_rand() % (REXMIT_TIME)),
-                   retransmit_callback, tc);
+        rto = rexmit_timeout(n);
+        if(rto == 0) {
+          rto = REXMIT_TIME;
+        }
+        ctimer_set(&s->retransmission_timer,
+                   rto + (random_rand() % rto),
+                   retransmit_callback, s);
       }
     }
 
@@ -306,35 +1083,194 @@ handle_ack(struct libp_conn *tc)
     }
     //set_keepalive_timer(tc);
   } else {
-    stats.badack++;
+    tc->stats.badack++;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Look up the seqno table entry for an originator. If there is no
+ * entry and create is set, the least recently used entry of those
+ * probed is taken over.
+ */
+static struct libp_seqno_entry *
+seqno_lookup(struct libp_conn *tc, const rimeaddr_t *originator, int create)
+{
+  struct libp_seqno_entry *e, *victim;
+  int h, k;
+
+  h = (originator->u8[0] + 31 * originator->u8[1]) % tc->seqno_table_size;
+  victim = NULL;
+  for(k = 0; k < SEQNO_TABLE_PROBES && k < tc->seqno_table_size; k++) {
+    e = &tc->seqno_table[(h + k) % tc->seqno_table_size];
+    if(e->conn == tc && rimeaddr_cmp(&e->originator, originator)) {
+      e->stamp = seqno_stamp;
+      return e;
+    }
+    if(victim == NULL ||
+       (victim->conn != NULL &&
+        (e->conn == NULL ||
+         (uint8_t)(seqno_stamp - e->stamp) >
+         (uint8_t)(seqno_stamp - victim->stamp)))) {
+      victim = e;
+    }
+  }
+  if(!create) {
+    return NULL;
+  }
+  victim->conn = tc;
+  rimeaddr_copy(&victim->originator, originator);
+  victim->stamp = seqno_stamp;
+  victim->seen = 0;
+  return victim;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Return how far eseqno is ahead of the last sequence number we have
+ * seen. A value of zero or below means that eseqno is not newer.
+ * Sequence numbers wrap within the upper half of the sequence number
+ * space (see libp_send()), so in the upper half we count modulo the
+ * half.
+ */
+static int
+seqno_distance(uint8_t eseqno, uint8_t last)
+{
+  int d;
+
+  if(eseqno >= SEQNO_HALF && last >= SEQNO_HALF) {
+    d = (eseqno - last) & (SEQNO_HALF - 1);
+    return d >= SEQNO_HALF / 2 ? d - SEQNO_HALF : d;
+  }
+  return (int)eseqno - (int)last;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * A sequence number in the lower half of the sequence number space
+ * after one in the upper half means that the originator has rebooted
+ * and its old window is no longer valid.
+ */
+static int
+seqno_rebooted(struct libp_seqno_entry *e, uint8_t eseqno)
+{
+  return eseqno < SEQNO_HALF && e->last >= SEQNO_HALF;
+}
+/*---------------------------------------------------------------------------*/
+static int
+is_duplicate_seqno(struct libp_conn *tc, const rimeaddr_t *originator,
+                   uint8_t eseqno)
+{
+  struct libp_seqno_entry *e;
+  int d;
+
+  e = seqno_lookup(tc, originator, 0);
+  if(e == NULL) {
+    return 0;
+  }
+  if(seqno_rebooted(e, eseqno)) {
+    return 0;
+  }
+  d = seqno_distance(eseqno, e->last);
+  if(d > 0 || d <= -SEQNO_WINDOW) {
+    return 0;
+  }
+  return (e->seen >> -d) & 1;
+}
+/*---------------------------------------------------------------------------*/
+static int
+is_duplicate_packet(struct libp_conn *tc)
+{
+  return is_duplicate_seqno(tc, packetbuf_addr(PACKETBUF_ADDR_ESENDER),
+                            packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID));
+}
+/*---------------------------------------------------------------------------*/
+static void
+remember_seqno(struct libp_conn *tc, const rimeaddr_t *originator,
+               uint8_t eseqno)
+{
+  struct libp_seqno_entry *e;
+  int d;
+
+  seqno_stamp++;
+  e = seqno_lookup(tc, originator, 1);
+  d = seqno_distance(eseqno, e->last);
+
+  if(e->seen == 0 || seqno_rebooted(e, eseqno) || d <= -SEQNO_WINDOW) {
+    /* A new originator, one that has rebooted, or a packet too old
+       for the window: start a new window. */
+    e->last = eseqno;
+    e->seen = 1;
+  } else if(d > 0) {
+    e->seen = d < SEQNO_WINDOW ? e->seen << d : 0;
+    e->seen |= 1;
+    e->last = eseqno;
+  } else {
+    e->seen |= (uint32_t)1 << -d;
   }
 }
 /*---------------------------------------------------------------------------*/
 static void
-add_packet_to_recent_packets(struct libp_conn *tc)
+remember_packet(struct libp_conn *tc)
 {
   /* Remember that we have seen this packet for later, but only if
      it has a length that is larger than zero. Packets with size
      zero are keepalive or proactive link estimate probes, so we do
      not record them in our history. */
   if(packetbuf_datalen() > sizeof(struct data_msg_hdr)) {
-    recent_packets[recent_packet_ptr].eseqno =
-      packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID);
-    rimeaddr_copy(&recent_packets[recent_packet_ptr].originator,
-                  packetbuf_addr(PACKETBUF_ADDR_ESENDER));
-    recent_packets[recent_packet_ptr].conn = tc;
-    recent_packet_ptr = (recent_packet_ptr + 1) % NUM_RECENT_PACKETS;
+    remember_seqno(tc, packetbuf_addr(PACKETBUF_ADDR_ESENDER),
+                   packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID));
   }
 }
+/*---------------------------------------------------------------------------*/
+/**
+ * Hand each record of an aggregated frame in the packetbuf to the
+ * application, as if it had been received on its own. A record can
+ * reach us more than once inside different frames, when a packet was
+ * aggregated again after its ACK was lost or after it was forked by
+ * an anycast transmission, so every record goes through the duplicate
+ * window of its originator.
+ */
 static void
-node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
+deliver_aggregate(struct libp_conn *tc)
+{
+  struct aggregate_record_hdr rec;
+  uint8_t hops;
+  int len, ptr;
+
+  hops = packetbuf_attr(PACKETBUF_ATTR_HOPS);
+  len = packetbuf_datalen();
+  memcpy(aggregate_buf, packetbuf_dataptr(), len);
+
+  for(ptr = 0; ptr + sizeof(struct aggregate_record_hdr) <= len;
+      ptr += sizeof(struct aggregate_record_hdr) + rec.len) {
+    memcpy(&rec, &aggregate_buf[ptr], sizeof(struct aggregate_record_hdr));
+    if(ptr + sizeof(struct aggregate_record_hdr) + rec.len > len) {
+      break;
+    }
+    packetbuf_copyfrom(&aggregate_buf[ptr + sizeof(struct aggregate_record_hdr)],
+                       rec.len);
+    packetbuf_set_addr(PACKETBUF_ADDR_ESENDER, &rec.originator);
+    packetbuf_set_attr(PACKETBUF_ATTR_EPACKET_ID, rec.eseqno);
+    packetbuf_set_attr(PACKETBUF_ATTR_HOPS, rec.hops + hops);
+    if(rec.len == 0) {
+      continue;
+    }
+    if(is_duplicate_seqno(tc, &rec.originator, rec.eseqno)) {
+      tc->stats.duprecv++;
+      continue;
+    }
+    remember_seqno(tc, &rec.originator, rec.eseqno);
+    if(tc->cb->recv != NULL) {
+      tc->cb->recv(&rec.originator, rec.eseqno, rec.hops + hops);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+packet_received(struct libp_conn *tc, const rimeaddr_t *from)
 {
-    struct libp_conn *tc = (struct libp_conn *)
-    ((char *)c - offsetof(struct libp_conn, unicast_conn));
-    int i;
     struct data_msg_hdr hdr;
     uint8_t ackflags = 0;
     struct libp_neighbour *n;
+    struct packetqueue_item *i;
 
     memcpy(&hdr, packetbuf_dataptr(), sizeof(struct data_msg_hdr));
 
@@ -344,21 +1280,28 @@ node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
          from->u8[0], from->u8[1], hdr.rtmetric);
   n = libp_neighbour_list_find(&tc->neighbour_list,
                                  packetbuf_addr(PACKETBUF_ADDR_SENDER));
-  if(n != NULL) {
-    libp_neighbour_update_rtmetric(n, hdr.rtmetric);
-    update_rtmetric(tc);
-  }
+  route_event(tc, n, libp_neighbour_update_rtmetric(n, hdr.rtmetric));
 
-  /* To protect against sending duplicate packets, we keep a list of
-     recently forwarded packet seqnos. If the seqno of the current
-     packet exists in the list, we immediately send an ACK and drop
-     the packet. */
+  /* To protect against sending duplicate packets, we keep a window
+     of recently forwarded packet seqnos for every originator. If the
+     seqno of the current packet is in the window, we immediately
+     send an ACK and drop the packet. */
   if(packetbuf_attr(PACKETBUF_ATTR_PACKET_TYPE) ==
      PACKETBUF_ATTR_PACKET_TYPE_DATA) {
     rimeaddr_t ack_to;
     uint8_t packet_seqno;
 
-    stats.datarecv++;
+    /* Keep track of the neighbors that use us as their parent. A
+       parent removed notice carries no payload and is not ACKed. */
+    child_update(tc, packetbuf_addr(PACKETBUF_ADDR_SENDER), hdr.flags);
+    if(hdr.flags & ACK_FLAGS_PARENT_REMOVED) {
+      return;
+    }
+    if(child_find(tc, packetbuf_addr(PACKETBUF_ADDR_SENDER)) != NULL) {
+      ackflags |= ACK_FLAGS_PARENT_CHOSEN;
+    }
+
+    tc->stats.datarecv++;
 
     /* Remember to whom we should send the ACK, since we reuse the
        packet buffer and its attributes when sending the ACK. */
@@ -368,27 +1311,23 @@ node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
     /* If the queue is more than half filled, we add the CONGESTED
        flag to our outgoing acks. */
 
-    if(packetqueue_len(&tc->send_queue) >= MAX_SENDING_QUEUE / 2) {
+    if(packetqueue_len(&tc->send_queue) >= QUEUE_SIZE(tc) / 2) {
       ackflags |= ACK_FLAGS_CONGESTED;
     }
 
-    for(i = 0; i < NUM_RECENT_PACKETS; i++) {
-      if(recent_packets[i].conn == tc &&
-         recent_packets[i].eseqno == packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID) &&
-         rimeaddr_cmp(&recent_packets[i].originator,
-                      packetbuf_addr(PACKETBUF_ADDR_ESENDER))) {
-        /* This is a duplicate of a packet we recently received, so we
-           just send an ACK. */
-        PRINTF("%d.%d: found duplicate packet from %d.%d with seqno %d, via %d.%d\n",
-               rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
-               recent_packets[i].originator.u8[0], recent_packets[i].originator.u8[1],
-               packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID),
-               packetbuf_addr(PACKETBUF_ADDR_SENDER)->u8[0],
-               packetbuf_addr(PACKETBUF_ADDR_SENDER)->u8[1]);
-        send_ack(tc, &ack_to, ackflags);
-        stats.duprecv++;
-        return;
-      }
+    if(is_duplicate_packet(tc)) {
+      /* This is a duplicate of a packet we recently received, so we
+         just send an ACK. */
+      PRINTF("%d.%d: found duplicate packet from %d.%d with seqno %d, via %d.%d\n",
+             rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+             packetbuf_addr(PACKETBUF_ADDR_ESENDER)->u8[0],
+             packetbuf_addr(PACKETBUF_ADDR_ESENDER)->u8[1],
+             packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID),
+             packetbuf_addr(PACKETBUF_ADDR_SENDER)->u8[0],
+             packetbuf_addr(PACKETBUF_ADDR_SENDER)->u8[1]);
+      send_ack(tc, &ack_to, ackflags);
+      tc->stats.duprecv++;
+      return;
     }
 
     /* If we are the sink, the packet has reached its final
@@ -396,13 +1335,13 @@ node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
     if(tc->rtmetric == RTMETRIC_SINK) {
       struct queuebuf *q;
 
-      add_packet_to_recent_packets(tc);
+      remember_packet(tc);
 
       /* We first send the ACK. We copy the data packet to a queuebuf
          first. */
       q = queuebuf_new_from_packetbuf();
       if(q != NULL) {
-        send_ack(tc, &ack_to, 0);
+        send_ack(tc, &ack_to, ackflags & ACK_FLAGS_PARENT_CHOSEN);
         queuebuf_to_packetbuf(q);
         queuebuf_free(q);
       } else {
@@ -410,7 +1349,7 @@ node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
                rimeaddr_node_addr.u8[0],rimeaddr_node_addr.u8[1],
                ack_to.u8[0], ack_to.u8[1],
                packet_seqno);
-        stats.ackdrop++;
+        tc->stats.ackdrop++;
       }
 
 
@@ -422,8 +1361,11 @@ node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
              from->u8[0], from->u8[1]);
 
       packetbuf_hdrreduce(sizeof(struct data_msg_hdr));
-      /* Call receive function. */
-      if(packetbuf_datalen() > 0 && tc->cb->recv != NULL) {
+      /* Call receive function, once for every packet in an aggregated
+         frame. */
+      if(hdr.flags & DATA_FLAGS_AGGREGATE) {
+        deliver_aggregate(tc);
+      } else if(packetbuf_datalen() > 0 && tc->cb->recv != NULL) {
         tc->cb->recv(packetbuf_addr(PACKETBUF_ADDR_ESENDER),
                      packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID),
                      packetbuf_attr(PACKETBUF_ATTR_HOPS));
@@ -463,20 +1405,23 @@ node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
          memory problems. We first check the size of our sending queue
          to ensure that we always have entries for packets that
          are originated by this node. */
-      if(packetqueue_len(&tc->send_queue) <= MAX_SENDING_QUEUE - MIN_AVAILABLE_QUEUE_ENTRIES &&
-         packetqueue_enqueue_packetbuf(&tc->send_queue,
-                                       FORWARD_PACKET_LIFETIME_BASE *
-                                       packetbuf_attr(PACKETBUF_ATTR_MAX_REXMIT),
-                                       tc)) {
-        add_packet_to_recent_packets(tc);
+      /* A packet of a higher traffic class may take the place of a
+         queued packet of a lower class. */
+      if(packetqueue_len(&tc->send_queue) >= FORWARD_QUEUE_SIZE(tc)) {
+        make_room(tc, hdr.tclass);
+      }
+      if(packetqueue_len(&tc->send_queue) < FORWARD_QUEUE_SIZE(tc) &&
+         (i = enqueue_packetbuf(tc, &hdr)) != NULL) {
+        remember_packet(tc);
         send_ack(tc, &ack_to, ackflags);
+        aggregate_queued_packet(tc, i);
         send_queued_packet(tc);
       } else {
         send_ack(tc, &ack_to,
                  ackflags | ACK_FLAGS_DROPPED | ACK_FLAGS_CONGESTED);
         PRINTF("%d.%d: packet dropped: no queue buffer available\n",
                   rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1]);
-        stats.qdrop++;
+        tc->stats.qdrop++;
       }
     } else if(packetbuf_attr(PACKETBUF_ATTR_TTL) <= 1) {
       PRINTF("%d.%d: packet dropped: ttl %d\n",
@@ -484,7 +1429,7 @@ node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
              packetbuf_attr(PACKETBUF_ATTR_TTL));
       send_ack(tc, &ack_to, ackflags |
                ACK_FLAGS_DROPPED | ACK_FLAGS_LIFETIME_EXCEEDED);
-      stats.ttldrop++;
+      tc->stats.ttldrop++;
     }
   } else if(packetbuf_attr(PACKETBUF_ATTR_PACKET_TYPE) ==
             PACKETBUF_ATTR_PACKET_TYPE_ACK) {
@@ -497,70 +1442,171 @@ node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
            packetbuf_attr(PACKETBUF_ATTR_PACKET_ID),
            tc->seqno);
     handle_ack(tc);
-    stats.ackrecv++;
   }
   return;
 }
+/*---------------------------------------------------------------------------*/
+static void
+node_packet_received(struct unicast_conn *c, const rimeaddr_t *from)
+{
+  struct libp_conn *tc = (struct libp_conn *)
+    ((char *)c - offsetof(struct libp_conn, unicast_conn));
+
+  packet_received(tc, from);
+}
 
 
 
 /*---------------------------------------------------------------------------*/
 static void
-timedout(struct libp_conn *c)
+timedout(struct libp_window_slot *s)
 {
+  struct libp_conn *c = s->c;
   struct libp_neighbour *n;
   PRINTF("%d.%d: timedout after %d retransmissions to %d.%d (max retransmissions %d): packet dropped\n",
-	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], c->transmissions,
-         c->current_parent.u8[0], c->current_parent.u8[1],
-         c->max_rexmits);
-  PRINTF("%d.%d: timedout after %d retransmissions to %d.%d (max retransmissions %d): packet dropped\n",
-	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], c->transmissions,
-         c->current_parent.u8[0], c->current_parent.u8[1],
-         c->max_rexmits);
-
-  c->sending = 0;
-  n = libp_neighbour_list_find(&c->neighbour_list,
-                                 &c->current_parent);
-  if(n != NULL) {
-    libp_neighbour_tx_fail(n, c->max_rexmits);
+	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], s->transmissions,
+         s->to.u8[0], s->to.u8[1],
+         s->max_rexmits);
+
+  /* The neighbour is charged only for the transmissions it has not
+     been charged for when we failed over from it. */
+  n = libp_neighbour_list_find(&c->neighbour_list, &s->to);
+  if(n != NULL && s->to_transmissions > 0) {
+    route_event(c, n, libp_neighbour_tx_fail(n, s->to_transmissions));
+  } else {
+    update_rtmetric(c);
   }
-  update_rtmetric(c);
-  send_next_packet(c);
+  send_next_packet(s);
   //set_keepalive_timer(c);
 }
 /*---------------------------------------------------------------------------*/
 
 
+static void
+packet_sent(struct libp_conn *tc, int status, int transmissions)
+{
+  struct libp_window_slot *s;
+
+  /* For data packets, we record the number of transmissions. Parent
+     removed notices are not sent reliably and are not accounted
+     for. */
+  if(packetbuf_attr(PACKETBUF_ATTR_PACKET_TYPE) ==
+     PACKETBUF_ATTR_PACKET_TYPE_DATA &&
+     packetbuf_attr(PACKETBUF_ATTR_RELIABLE)) {
+
+    /* The packet may already have been ACKed and removed from the
+       window, in which case there is nothing left to account for. */
+    s = window_find(tc, packetbuf_attr(PACKETBUF_ATTR_PACKET_ID));
+    if(s == NULL) {
+      return;
+    }
+
+    s->transmissions += transmissions;
+    s->to_transmissions += transmissions;
+    if(s->probe) {
+      tc->probe_transmissions += transmissions;
+    }
+    PRINTF("tx %d\n", s->transmissions);
+    PRINTF("%d.%d: MAC sent %d transmissions to %d.%d, status %d, total transmissions %d\n",
+           rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+           transmissions,
+           s->to.u8[0], s->to.u8[1],
+           status, s->transmissions);
+    if(s->transmissions >= s->max_rexmits) {
+      timedout(s);
+      tc->stats.timedout++;
+    } else {
+      clock_time_t time, elapsed;
+
+      /* Wait for the ACK until the retransmission timeout, counted
+         from when the packet was handed to the MAC layer, has
+         passed. */
+      time = rexmit_timeout(libp_neighbour_list_find(&tc->neighbour_list,
+                                                     &s->to));
+      if(time == 0) {
+        time = REXMIT_TIME / 2 + (random_rand() % (REXMIT_TIME / 2));
+      } else {
+        elapsed = clock_time() - s->send_time;
+        time = time > elapsed + MIN_REXMIT_TIME / 2 ?
+          time - elapsed : MIN_REXMIT_TIME / 2;
+        time += random_rand() % (time / 4 + 1);
+      }
+      PRINTF("retransmission time %lu\n", time);
+      ctimer_set(&s->retransmission_timer, time,
+                 retransmit_callback, s);
+    }
+  }
+}
+
+
 static void
 node_packet_sent(struct unicast_conn *c, int status, int transmissions)
 {
-     struct libp_conn *tc = (struct libp_conn *)
+  struct libp_conn *tc = (struct libp_conn *)
     ((char *)c - offsetof(struct libp_conn, unicast_conn));
 
-  /* For data packets, we record the number of transmissions */
-  if(packetbuf_attr(PACKETBUF_ATTR_PACKET_TYPE) ==
-     PACKETBUF_ATTR_PACKET_TYPE_DATA) {
+  packet_sent(tc, status, transmissions);
+}
+/*---------------------------------------------------------------------------*/
+static void
+anycast_recv(struct broadcast_conn *c, const rimeaddr_t *from)
+{
+  struct libp_conn *tc = (struct libp_conn *)
+    ((char *)c - offsetof(struct libp_conn, anycast_conn));
+  struct anycast_hdr ahdr;
+  struct data_msg_hdr hdr;
+  uint8_t *data;
+  int k;
+
+  if(packetbuf_datalen() < sizeof(struct anycast_hdr) +
+     sizeof(struct data_msg_hdr)) {
+    return;
+  }
+  data = packetbuf_dataptr();
+  memcpy(&ahdr, data, sizeof(struct anycast_hdr));
+  for(k = 0; k < ahdr.num && k < ANYCAST_CANDIDATES; k++) {
+    if(rimeaddr_cmp(&ahdr.candidates[k], &rimeaddr_node_addr)) {
+      break;
+    }
+  }
+  if(k == ahdr.num || k == ANYCAST_CANDIDATES) {
+    return;
+  }
 
-    tc->transmissions += transmissions;
-    PRINTF("tx %d\n", tc->transmissions);
-    PRINTF("%d.%d: MAC sent %d transmissions to %d.%d, status %d, total transmissions %d\n",
-           rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
-           transmissions,
-           tc->current_parent.u8[0], tc->current_parent.u8[1],
-           status, tc->transmissions);
-    if(tc->transmissions >= tc->max_rexmits) {
-      timedout(tc);
-      stats.timedout++;
-    } else {
-      clock_time_t time = REXMIT_TIME / 2 + (random_rand() % (REXMIT_TIME / 2));
-      PRINTF("retransmission time %lu\n", time);
-      ctimer_set(&tc->retransmission_timer, time,
-                 retransmit_callback, tc);
+  /* Strip the anycast header, so that the packet looks like one that
+     was unicast to us. */
+  memmove(data, data + sizeof(struct anycast_hdr),
+          packetbuf_datalen() - sizeof(struct anycast_hdr));
+  packetbuf_set_datalen(packetbuf_datalen() - sizeof(struct anycast_hdr));
+
+  memcpy(&hdr, data, sizeof(struct data_msg_hdr));
+  if(k > 0) {
+    /* A backup only takes the packet if it brings it closer to the
+       sink, and it does not become the sender's parent by doing so:
+       only the first candidate handles the parent flags. */
+    if(hdr.flags & ACK_FLAGS_PARENT_REMOVED ||
+       tc->rtmetric >= hdr.rtmetric) {
+      return;
     }
+    hdr.flags &= ~ACK_FLAGS_PARENT_CHOSEN;
   }
+  hdr.flags |= DATA_FLAGS_ANYCAST;
+  memcpy(data, &hdr, sizeof(struct data_msg_hdr));
+  PRINTF("%d.%d: anycast packet from %d.%d, candidate %d\n",
+         rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+         from->u8[0], from->u8[1], k);
+  packet_received(tc, from);
 }
+/*---------------------------------------------------------------------------*/
+static void
+anycast_sent(struct broadcast_conn *c, int status, int transmissions)
+{
+  struct libp_conn *tc = (struct libp_conn *)
+    ((char *)c - offsetof(struct libp_conn, anycast_conn));
 
-
+  packet_sent(tc, status, transmissions);
+}
+/*---------------------------------------------------------------------------*/
 static void
 received_announcement(struct announcement *a, const rimeaddr_t *from, uint16_t id, uint16_t value)
 {
@@ -573,10 +1619,12 @@ received_announcement(struct announcement *a, const rimeaddr_t *from, uint16_t i
     if(n == NULL) {
     /* only add neighbours with a lower rank than ours */
         if(value < c->rtmetric) {
-            libp_neighbour_list_add(&c->neighbour_list, from, value);
+            libp_neighbour_list_add(&c->neighbour_list, from, value,
+                                    &c->parent);
             PRINTF("%d.%d: new neighbor %d.%d, rtmetric %d\n",
              rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
              from->u8[0], from->u8[1], value);
+            update_rtmetric(c);
         }
     } else {
     /* Check if the advertised rtmetric has changed to
@@ -591,26 +1639,69 @@ received_announcement(struct announcement *a, const rimeaddr_t *from, uint16_t i
        libp_neighbour_rtmetric(n) != RTMETRIC_MAX) {
       bump_advertisement(c);
     }
-    libp_neighbour_update_rtmetric(n, value);
     PRINTF("%d.%d: updating neighbor %d.%d, etx %d\n",
 	   rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
 	   n->addr.u8[0], n->addr.u8[1], value);
+    route_event(c, n, libp_neighbour_update_rtmetric(n, value));
   }
 
-  update_rtmetric(c);
-
     PRINTF("received announcement from %d.%d \n", from->u8[0], from->u8[1]);
 }
 
 static void
 broadcast_recv(struct broadcast_conn *c, const rimeaddr_t *from)
 {
+    struct libp_conn *tc = (struct libp_conn *)
+      ((char *)c - offsetof(struct libp_conn, broadcast_conn));
+    struct beacon_message msg;
+    struct libp_neighbour *n;
+    uint32_t delta;
+
     PRINTF("beacon received from %d.%d \n",from->u8[0], from->u8[1]);
-    //PRINTF("current parent: %d.%d \n", l->parent.u8[0], l->parent.u8[1]);
 
-    if(!l->is_sink) { //fix
-        clock_time_t period = REBROADCAST_TIME*CLOCK_SECOND;
-        libp_set_beacon_period(l,period);
+    if(packetbuf_datalen() < sizeof(struct beacon_message)) {
+        return;
+    }
+    memcpy(&msg, packetbuf_dataptr(), sizeof(struct beacon_message));
+
+    /* Beacons let us estimate the link from a neighbor before we
+       send any data to it. Like announcements, they add neighbors
+       with a lower rtmetric than ours. */
+    n = libp_neighbour_list_find(&tc->neighbour_list, from);
+    if(n == NULL && msg.rtmetric < tc->rtmetric) {
+        libp_neighbour_list_add(&tc->neighbour_list, from, msg.rtmetric,
+                                &tc->parent);
+        n = libp_neighbour_list_find(&tc->neighbour_list, from);
+        if(n != NULL) {
+            libp_neighbour_rx(n, msg.seqno);
+            libp_neighbour_update_children(n, msg.children);
+            update_rtmetric(tc);
+        }
+    } else if(n != NULL) {
+        delta = libp_neighbour_rx(n, msg.seqno);
+        delta += libp_neighbour_update_rtmetric(n, msg.rtmetric);
+        delta += libp_neighbour_update_children(n, msg.children);
+        route_event(tc, n, delta);
+    }
+    set_parent_congestion(tc, from, msg.congestion);
+
+    /* A non-sink starts beaconing when it first hears a beacon. */
+    if(tc->beacon_interval == 0) {
+        if(!tc->is_sink) {
+            set_beacon_timer(tc);
+        }
+        return;
+    }
+
+    /* A beacon from a neighbor that has a route is consistent with
+       ours and counts towards suppressing our own beacon. A neighbor
+       that has lost its route needs to hear from us soon. */
+    if(msg.rtmetric != RTMETRIC_MAX) {
+        if(tc->beacon_counter < 0xff) {
+            tc->beacon_counter++;
+        }
+    } else if(tc->rtmetric != RTMETRIC_MAX) {
+        reset_beacon_timer(tc);
     }
 }
 
@@ -618,7 +1709,7 @@ broadcast_recv(struct broadcast_conn *c, const rimeaddr_t *from)
 static int
 enqueue_dummy_packet(struct libp_conn *c, int rexmits)
 {
-  struct libp_neighbor *n;
+  struct libp_neighbour *n;
 
   packetbuf_clear();
   packetbuf_set_attr(PACKETBUF_ATTR_EPACKET_ID, c->eseqno - 1);
@@ -634,6 +1725,7 @@ enqueue_dummy_packet(struct libp_conn *c, int rexmits)
 
   /* Allocate space for the header. */
   packetbuf_hdralloc(sizeof(struct data_msg_hdr));
+  memset(packetbuf_hdrptr(), 0, sizeof(struct data_msg_hdr));
 
   n = libp_neighbour_list_find(&c->neighbour_list, &c->parent);
   if(n != NULL) {
@@ -645,159 +1737,330 @@ enqueue_dummy_packet(struct libp_conn *c, int rexmits)
 }
 /*---------------------------------------------------------------------------*/
 static void
-proactive_probing_callback(void *ptr)
+set_probing_timer(struct libp_conn *c)
 {
-    struct libp_conn *c = ptr;
-    struct packetqueue_item *i;
+  clock_time_t interval;
+
+  interval = PROACTIVE_PROBING_INTERVAL << c->probe_backoff;
+  ctimer_set(&c->proactive_probing_timer,
+             interval / 2 + random_rand() % interval,
+             proactive_probing_callback, c);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * How much we want to probe n, or 0 if it is not worth it. Stale
+ * estimates, estimates we have little confidence in, and neighbors
+ * that could improve most on our parent come first.
+ */
+static uint32_t
+probe_priority(struct libp_conn *c, struct libp_neighbour *n,
+               uint16_t parent_cost)
+{
+  uint32_t staleness, improvement, best_case;
+  int estimates;
+
+  if(rimeaddr_cmp(&n->addr, &c->parent) ||
+     n->rtmetric + LIBP_LINK_METRIC_UNIT >= c->rtmetric) {
+    return 0;
+  }
+
+  estimates = libp_link_metric_num_metrics(&n->lm);
+  staleness = clock_seconds() - n->last_estimated;
+  if(estimates > 0 && staleness < PROACTIVE_PROBING_MIN_AGE) {
+    return 0;
+  }
+  if(estimates == 0 || staleness > 60 * 60) {
+    staleness = 60 * 60;
+  }
+
+  /* The cost n would have if its link to us were perfect. */
+  best_case = n->rtmetric + LIBP_LINK_METRIC_UNIT +
+    libp_link_metric_children(&n->lm) / 2;
+  if(best_case >= (uint32_t)parent_cost + PROACTIVE_PROBING_MARGIN) {
+    return 0;
+  }
+  improvement = parent_cost + PROACTIVE_PROBING_MARGIN - best_case;
 
-    ctimer_set(&c->proactive_probing_timer, PROACTIVE_PROBING_INTERVAL,
-             proactive_probing_callback, ptr);
+  if(estimates > 8) {
+    estimates = 8;
+  }
+  return (staleness / 60 + 1) * improvement / (estimates + 1);
+}
+/*---------------------------------------------------------------------------*/
+static void
+proactive_probing_callback(void *ptr)
+{
+  struct libp_conn *c = ptr;
+  struct libp_neighbour *n, *candidate, *parent;
+  uint32_t priority, best_priority;
+  uint16_t parent_cost;
+  rimeaddr_t current_parent;
 
   /* Only do proactive link probing if we are not the sink and if we
      have a route. */
-  if(c->rtmetric != RTMETRIC_SINK && c->rtmetric != RTMETRIC_MAX) {
-  /* Grab the first packet on the send queue to see if the queue is
-     empty or not. */
-  i = packetqueue_first(&c->send_queue);
-  if(i == NULL) {
-    /* If there are no packets to send, we go through the list of
-       neighbors to find a potential parent for which we do not have a
-       link estimate and send a dummy packet to it. This allows us to
-       quickly gauge the link quality of neighbors that we do not
-       currently use as parents. */
-      struct libp_neighbour *n;
-
-      /* Find the neighbor with the lowest number of estimates. */
-      for(n = list_head(libp_neighbour_list(&c->neighbour_list));
-          n != NULL; n = list_item_next(n)) {
-        if(n->rtmetric + LIBP_LINK_METRIC_UNIT < c->rtmetric &&
-           libp_link_metric_num_metrics(&n->lm) == 0) {
-          rimeaddr_t current_parent;
-
-          PRINTF("proactive_probing_callback: found neighbor with no link estimate, %d.%d\n",
-                 n->addr.u8[RIMEADDR_SIZE - 2], n->addr.u8[RIMEADDR_SIZE - 1]);
-
-          rimeaddr_copy(&current_parent, &c->parent);
-          rimeaddr_copy(&c->parent, &n->addr);
-          if(enqueue_dummy_packet(c, PROACTIVE_PROBING_REXMITS)) {
-            send_queued_packet(c);
-          }
-          rimeaddr_copy(&c->parent, &current_parent);
-          return;
-        }
-      }
+  if(c->rtmetric == RTMETRIC_SINK || c->rtmetric == RTMETRIC_MAX) {
+    set_probing_timer(c);
+    return;
+  }
+
+  /* Probes would only compete with the packets on the send queue, so
+     we back off while it is busy. */
+  if(packetqueue_first(&c->send_queue) != NULL || c->sending > 0) {
+    if(c->probe_backoff < PROACTIVE_PROBING_MAX_BACKOFF) {
+      c->probe_backoff++;
     }
-    PRINTF("%d.%d: nothing on queue\n",
+    PRINTF("%d.%d: queue busy, probing backoff %d\n",
+           rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+           c->probe_backoff);
+    set_probing_timer(c);
+    return;
+  }
+  c->probe_backoff = 0;
+  set_probing_timer(c);
+
+  if(clock_seconds() - c->probe_budget_start >= 60 * 60) {
+    c->probe_budget_start = clock_seconds();
+    c->probe_transmissions = 0;
+  }
+  if(c->probe_transmissions + PROACTIVE_PROBING_REXMITS >
+     PROACTIVE_PROBING_BUDGET) {
+    PRINTF("%d.%d: probing budget spent\n",
            rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1]);
     return;
   }
+
+  parent = libp_neighbour_list_find(&c->neighbour_list, &c->parent);
+  parent_cost = parent != NULL ?
+    libp_neighbour_parent_cost(parent, c->parent_confirmed) : RTMETRIC_MAX;
+
+  candidate = NULL;
+  best_priority = 0;
+  for(n = list_head(libp_neighbour_list(&c->neighbour_list));
+      n != NULL; n = list_item_next(n)) {
+    priority = probe_priority(c, n, parent_cost);
+    if(priority > best_priority) {
+      best_priority = priority;
+      candidate = n;
+    }
+  }
+  if(candidate == NULL) {
+    return;
+  }
+
+  PRINTF("proactive_probing_callback: probing %d.%d, priority %lu\n",
+         candidate->addr.u8[RIMEADDR_SIZE - 2],
+         candidate->addr.u8[RIMEADDR_SIZE - 1],
+         (unsigned long)best_priority);
+
+  /* The probe is a dummy packet sent as if the neighbor were our
+     parent. Its transmissions are charged against the budget as they
+     are made. */
+  rimeaddr_copy(&current_parent, &c->parent);
+  rimeaddr_copy(&c->parent, &candidate->addr);
+  if(enqueue_dummy_packet(c, PROACTIVE_PROBING_REXMITS)) {
+    send_queued_packet(c);
+  }
+  rimeaddr_copy(&c->parent, &current_parent);
 }
 /*---------------------------------------------------------------------------*/
 static void
-send_packet(struct libp_conn *c, struct libp_neighbour *n)
+send_packet(struct libp_window_slot *s, struct libp_neighbour *n)
 {
+  struct libp_conn *c = s->c;
   clock_time_t time;
 
   PRINTF("Sending packet to %d.%d, %d transmissions\n",
          n->addr.u8[0], n->addr.u8[1],
-         c->transmissions);
+         s->transmissions);
   /* Defensive programming: if a bug in the MAC/RDC layers will cause
      it to not call us back, we'll set up the retransmission timer
      with a high timeout, so that we can cancel the transmission and
      send a new one. */
   time = 16 * REXMIT_TIME;
-  ctimer_set(&c->retransmission_timer, time,
-             retransmit_not_sent_callback, c);
-  c->send_time = clock_time();
+  ctimer_set(&s->retransmission_timer, time,
+             retransmit_not_sent_callback, s);
+  s->send_time = clock_time();
 
-  unicast_send(&c->unicast_conn, &n->addr);
+  if(s->anycast) {
+    broadcast_send(&c->anycast_conn);
+  } else {
+    unicast_send(&c->unicast_conn, &n->addr);
+  }
 }
 /*---------------------------------------------------------------------------*/
 /**
- * This function is called to retransmit the first packet on the send
- * queue.
- *
+ * In opportunistic mode, put an anycast header naming the neighbor n
+ * and the backup parents in front of the packet in the packet buffer.
+ * Returns non-zero if there was more than one candidate.
+ */
+static int
+add_anycast_hdr(struct libp_conn *c, struct libp_neighbour *n)
+{
+  struct anycast_hdr ahdr;
+  struct libp_neighbour *parent, *backup;
+  int k;
+
+  if(!c->opportunistic || c->rtmetric == RTMETRIC_MAX) {
+    return 0;
+  }
+
+  memset(&ahdr, 0, sizeof(struct anycast_hdr));
+  rimeaddr_copy(&ahdr.candidates[0], &n->addr);
+  ahdr.num = 1;
+  parent = libp_neighbour_list_find(&c->neighbour_list, &c->parent);
+  for(k = 0; ahdr.num < ANYCAST_CANDIDATES; k++) {
+    backup = libp_neighbour_list_backup(&c->neighbour_list, parent, k);
+    if(backup == NULL) {
+      break;
+    }
+    if(backup != n) {
+      rimeaddr_copy(&ahdr.candidates[ahdr.num++], &backup->addr);
+    }
+  }
+  if(ahdr.num == 1 || !packetbuf_hdralloc(sizeof(struct anycast_hdr))) {
+    return 0;
+  }
+  memcpy(packetbuf_hdrptr(), &ahdr, sizeof(struct anycast_hdr));
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * This function places the packet held by a window slot into the
+ * packet buffer, sets up the packet attributes and the header, and
+ * sends it to the neighbor n.
  */
 static void
-retransmit_current_packet(struct libp_conn *c)
+transmit_slot(struct libp_window_slot *s, struct libp_neighbour *n)
 {
-  struct queuebuf *q;
-  struct libp_neighbour *n;
-  struct packetqueue_item *i;
+  struct libp_conn *c = s->c;
   struct data_msg_hdr hdr;
   int max_mac_rexmits;
 
-  /* Grab the first packet on the send queue, which is the one we are
-     about to retransmit. */
-  i = packetqueue_first(&c->send_queue);
-  if(i == NULL) {
-      PRINTF("%d.%d: nothing on queue\n",
-	     rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1]);
-    /* No packet on the queue, so there is nothing for us to send. */
-    return;
-  }
-
-  /* Get hold of the queuebuf. */
-  q = packetqueue_queuebuf(i);
-  if(q != NULL) {
+  /* Place the queued packet into the packetbuf. */
+  queuebuf_to_packetbuf(packetqueue_queuebuf(s->item));
 
-    update_rtmetric(c);
+  PRINTF("%d.%d: sending packet to %d.%d with eseqno %d\n",
+	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+	 n->addr.u8[0], n->addr.u8[1],
+         packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID));
 
-    /* Place the queued packet into the packetbuf. */
-    queuebuf_to_packetbuf(q);
+  /* Set the packet attributes: this packet wants an ACK, so we sent
+     the PACKETBUF_ATTR_RELIABLE flag; the MAC should retry
+     MAX_MAC_REXMITS times, but not more than what is left of the
+     retransmission budget; and the PACKETBUF_ATTR_PACKET_ID is set to
+     the sequence number of the window slot. */
+  packetbuf_set_attr(PACKETBUF_ATTR_RELIABLE, 1);
+  max_mac_rexmits = s->max_rexmits - s->transmissions > MAX_MAC_REXMITS?
+    MAX_MAC_REXMITS : s->max_rexmits - s->transmissions;
+  packetbuf_set_attr(PACKETBUF_ATTR_MAX_MAC_TRANSMISSIONS, max_mac_rexmits);
+  packetbuf_set_attr(PACKETBUF_ATTR_PACKET_ID, s->seqno);
+
+  /* Copy our rtmetric, and the time left before the deadline, into
+     the packet header of the outgoing packet. The header flags and
+     the traffic class describe the packet and are kept, except for
+     the parent flags, which describe this hop. */
+  memcpy(&hdr, packetbuf_dataptr(), sizeof(struct data_msg_hdr));
+  hdr.rtmetric = c->rtmetric;
+  hdr.flags &= ~(ACK_FLAGS_PARENT_CHOSEN | ACK_FLAGS_PARENT_REMOVED);
+  /* A probe is sent as if the neighbor were our parent, but must not
+     make the neighbor count us as a child, so it never announces the
+     parent choice. */
+  if(!c->parent_confirmed && !s->probe &&
+     rimeaddr_cmp(&s->to, &c->parent)) {
+    hdr.flags |= ACK_FLAGS_PARENT_CHOSEN;
+  }
+  if(s->has_deadline) {
+    hdr.deadline = CLOCK_LT(clock_time(), s->deadline) ?
+      s->deadline - clock_time() : 1;
+  }
+  memcpy(packetbuf_dataptr(), &hdr, sizeof(struct data_msg_hdr));
 
-    /* Pick the neighbor to which to send the packet. If we have found
-       a better parent while we were transmitting this packet, we
-       chose that neighbor instead. If so, we need to attribute the
-       transmissions we made for the parent to that neighbor. */
-    if(!rimeaddr_cmp(&c->current_parent, &c->parent)) {
-      /*      struct collect_neighbor *current_neighbor;
-      current_neighbor = collect_neighbor_list_find(&c->neighbor_list,
-                                                    &c->current_parent);
-      if(current_neighbor != NULL) {
-        collect_neighbor_tx(current_neighbor, c->max_rexmits);
-        }*/
+  s->anycast = !s->probe && add_anycast_hdr(c, n);
 
-      PRINTF("parent change from %d.%d to %d.%d after %d tx\n",
-             c->current_parent.u8[0], c->current_parent.u8[1],
-             c->parent.u8[0], c->parent.u8[1],
-             c->transmissions);
+  /* Send the packet. */
+  send_packet(s, n);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * This function is called to retransmit the packet held by a window
+ * slot.
+ *
+ */
+static void
+retransmit_current_packet(struct libp_window_slot *s)
+{
+  struct libp_conn *c = s->c;
+  struct libp_neighbour *n, *backup;
 
-      rimeaddr_copy(&c->current_parent, &c->parent);
-      c->transmissions = 0;
-    }
-    n = libp_neighbour_list_find(&c->neighbour_list, &c->current_parent);
+  update_rtmetric(c);
 
+  /* A probe is only of use to the neighbor it probes, so it is not
+     redirected. */
+  if(s->probe) {
+    s->retransmitted = 1;
+    n = libp_neighbour_list_find(&c->neighbour_list, &s->to);
     if(n != NULL) {
+      transmit_slot(s, n);
+    } else {
+      send_next_packet(s);
+    }
+    return;
+  }
 
-      /* If the connection had a neighbor, we construct the packet
-         buffer attributes and set the appropriate flags in the
-         Collect connection structure and send the packet. */
-
-      PRINTF("%d.%d: sending packet to %d.%d with eseqno %d\n",
-	     rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
-	     n->addr.u8[0], n->addr.u8[1],
-             packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID));
-
-      /* Mark that we are currently sending a packet. */
-      c->sending = 1;
-      packetbuf_set_attr(PACKETBUF_ATTR_RELIABLE, 1);
-      max_mac_rexmits = c->max_rexmits - c->transmissions > MAX_MAC_REXMITS?
-        MAX_MAC_REXMITS : c->max_rexmits - c->transmissions;
-      packetbuf_set_attr(PACKETBUF_ATTR_MAX_MAC_TRANSMISSIONS, max_mac_rexmits);
-      packetbuf_set_attr(PACKETBUF_ATTR_PACKET_ID, c->seqno);
-
-      /* Copy our rtmetric into the packet header of the outgoing
-         packet. */
-      memset(&hdr, 0, sizeof(hdr));
-      hdr.rtmetric = c->rtmetric;
-      memcpy(packetbuf_dataptr(), &hdr, sizeof(struct data_msg_hdr));
-
-      /* Send the packet. */
-      send_packet(c, n);
+  /* If the neighbor keeps failing us, we move on to the next backup
+     parent without waiting for its link metric to catch up. The
+     neighbor is charged for the transmissions made to it, and all
+     transmissions made so far count against the budget of the
+     packet. */
+  if(s->transmissions > 0 && ++s->failures >= FAILOVER_FAILURES) {
+    n = libp_neighbour_list_find(&c->neighbour_list, &s->to);
+    if(s->to_transmissions > 0) {
+      route_event(c, n, libp_neighbour_tx_fail(n, s->to_transmissions));
+      s->to_transmissions = 0;
+    }
+    backup = libp_neighbour_list_backup(&c->neighbour_list,
+                                        libp_neighbour_list_find(&c->neighbour_list,
+                                                                 &c->parent),
+                                        s->rank);
+    if(backup != NULL && !rimeaddr_cmp(&backup->addr, &s->to)) {
+      PRINTF("%d.%d: failing over from %d.%d to %d.%d after %d tx\n",
+             rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+             s->to.u8[0], s->to.u8[1],
+             backup->addr.u8[0], backup->addr.u8[1],
+             s->transmissions);
+      rimeaddr_copy(&s->to, &backup->addr);
+      s->rank++;
     }
+    s->failures = 0;
+  }
+
+  /* Pick the neighbor to which to send the packet. If we have found
+     a better parent while we were transmitting this packet, we
+     chose that neighbor instead. If so, we need to attribute the
+     transmissions we made for the parent to that neighbor. */
+  if(s->rank == 0 && !rimeaddr_cmp(&s->to, &c->parent)) {
+    PRINTF("parent change from %d.%d to %d.%d after %d tx\n",
+           s->to.u8[0], s->to.u8[1],
+           c->parent.u8[0], c->parent.u8[1],
+           s->transmissions);
+
+    rimeaddr_copy(&s->to, &c->parent);
+    rimeaddr_copy(&c->current_parent, &c->parent);
+    s->transmissions = 0;
+    s->to_transmissions = 0;
   }
+  s->retransmitted = 1;
+  n = libp_neighbour_list_find(&c->neighbour_list, &s->to);
 
+  if(n != NULL) {
+    transmit_slot(s, n);
+  } else {
+    /* We have nobody to send the packet to, so it goes back on the
+       queue until we find a route. */
+    PRINTF("%d.%d: no neighbor for packet %d, back on queue\n",
+	   rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], s->seqno);
+    window_return(s);
+  }
 }
 /*---------------------------------------------------------------------------*/
 
@@ -805,32 +2068,39 @@ retransmit_current_packet(struct libp_conn *c)
 static void
 retransmit_not_sent_callback(void *ptr)
 {
-  struct libp_conn *c = ptr;
+  struct libp_window_slot *s = ptr;
 
-  PRINTF("retransmit not sent, %d transmissions\n", c->transmissions);
-  c->transmissions += MAX_MAC_REXMITS + 1;
-  retransmit_callback(c);
+  PRINTF("retransmit not sent, %d transmissions\n", s->transmissions);
+  s->transmissions += MAX_MAC_REXMITS + 1;
+  retransmit_callback(s);
 }
 /*---------------------------------------------------------------------------*/
 /**
  * This function is called from a ctimer that is setup when a packet
  * is sent. The purpose of this function is to either retransmit the
- * current packet, or timeout the packet. The descision is made
- * depending on how many times the packet has been transmitted. The
- * ctimer is set up in the function node_packet_sent().
+ * packet held by the window slot, or timeout the packet. The
+ * descision is made depending on how many times the packet has been
+ * transmitted. The ctimer is set up in the function
+ * node_packet_sent().
  */
 static void
 retransmit_callback(void *ptr)
 {
-  struct libp_conn *c = ptr;
-
-  PRINTF("retransmit, %d transmissions\n", c->transmissions);
-  if(c->transmissions >= c->max_rexmits) {
-    timedout(c);
-    stats.timedout++;
+  struct libp_window_slot *s = ptr;
+
+  PRINTF("retransmit, %d transmissions\n", s->transmissions);
+  if(s->has_deadline && !CLOCK_LT(clock_time(), s->deadline)) {
+    /* The packet has missed its deadline, so there is no point in
+       retransmitting it. This is not the fault of the parent. */
+    PRINTF("%d.%d: packet %d missed its deadline: packet dropped\n",
+           rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], s->seqno);
+    s->c->stats.deadlinedrop++;
+    send_next_packet(s);
+  } else if(s->transmissions >= s->max_rexmits) {
+    timedout(s);
+    s->c->stats.timedout++;
   } else {
-    c->sending = 0;
-    retransmit_current_packet(c);
+    retransmit_current_packet(s);
   }
 }
 /*---------------------------------------------------------------------------*/
@@ -840,35 +2110,88 @@ static const struct unicast_callbacks unicast_callbacks = {node_packet_received,
                                                            node_packet_sent};
 
 static const struct broadcast_callbacks broadcast_call = { broadcast_recv};
+
+static const struct broadcast_callbacks anycast_call = { anycast_recv,
+                                                         anycast_sent };
 /*---------------------------------------------------------------------------*/
+static void start_beacon_interval(struct libp_conn *c);
+
 static void
 send_beacon(void *ptr)
 {
     struct libp_conn *c = ptr;
     struct beacon_message msg;
-    msg.rtmetric = c->rtmetric;
-    packetbuf_copyfrom(&msg, sizeof(struct beacon_message));
-    broadcast_send(&c->broadcast_conn);
-    PRINTF("Sending beacon\n");
-    if(c->is_sink) {
-        clock_time_t period = BEACONING_PERIOD * CLOCK_SECOND;
-        libp_set_beacon_period(c, period);
-        //calling non-static method from static context, but it still works?
+
+    if(c->beacon_fired) {
+        /* The interval has ended. Double it, up to the maximum. */
+        if(c->beacon_interval < (c->beacon_period << BEACON_DOUBLINGS) &&
+           c->beacon_interval <= ((clock_time_t)~0) / 2) {
+            c->beacon_interval *= 2;
+        }
+        start_beacon_interval(c);
+        return;
+    }
+
+    if(c->beacon_counter < BEACON_REDUNDANCY) {
+        memset(&msg, 0, sizeof(msg));
+        msg.rtmetric = c->rtmetric;
+        msg.children = num_children(c);
+        msg.congestion = congestion_level(c);
+        /* The sequence number only advances with the beacons we
+           actually send, so that receivers can count the ones they
+           missed. */
+        msg.seqno = c->beacon_seqno++;
+        packetbuf_copyfrom(&msg, sizeof(struct beacon_message));
+        broadcast_send(&c->broadcast_conn);
+        PRINTF("Sending beacon\n");
+    } else {
+        PRINTF("Suppressing beacon, heard %d\n", c->beacon_counter);
     }
 
+    c->beacon_fired = 1;
+    ctimer_set(&c->beacon_timer, c->beacon_interval - c->beacon_fire_time,
+               send_beacon, c);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Start a new Trickle interval: pick the beacon time in the second
+ * half of the interval and forget the beacons heard so far.
+ */
+static void
+start_beacon_interval(struct libp_conn *c)
+{
+  c->beacon_counter = 0;
+  c->beacon_fired = 0;
+  c->beacon_fire_time = c->beacon_interval / 2 +
+    random_rand() % (c->beacon_interval / 2 + 1);
+  ctimer_set(&c->beacon_timer, c->beacon_fire_time, send_beacon, c);
 }
 /*---------------------------------------------------------------------------*/
 static void
 set_beacon_timer(struct libp_conn *c)
 {
   if(c->beacon_period != 0) {
-    ctimer_set(&c->beacon_timer, (c->beacon_period / 2) +
-               (random_rand() % (c->beacon_period / 2)),
-               send_beacon, c);
+    c->beacon_interval = c->beacon_period;
+    start_beacon_interval(c);
   } else {
+    c->beacon_interval = 0;
     ctimer_stop(&c->beacon_timer);
   }
 }
+/*---------------------------------------------------------------------------*/
+/**
+ * Called on an inconsistency: fall back to the shortest interval,
+ * unless we are already there or not beaconing at all.
+ */
+static void
+reset_beacon_timer(struct libp_conn *c)
+{
+  if(c->beacon_interval > c->beacon_period) {
+    PRINTF("reset_beacon_timer: interval %lu\n",
+           (unsigned long)c->beacon_interval);
+    set_beacon_timer(c);
+  }
+}
 
 void libp_set_beacon_period(struct libp_conn *c, clock_time_t period)
 {
@@ -892,6 +2215,7 @@ static void
 bump_advertisement(struct libp_conn *c)
 {
   announcement_bump(&c->announcement);
+  reset_beacon_timer(c);
 }
 
 static void update_parent(struct libp_conn *c)
@@ -899,13 +2223,19 @@ static void update_parent(struct libp_conn *c)
     struct libp_neighbour *current;
     struct libp_neighbour *best;
 
-  /* We grab the collect_neighbor struct of our current parent. */
-  current = libp_neighbour_list_find(&c->neighbour_list, &c->parent);
-
   /* We call the collect_neighbor module to find the current best
-     parent. */
+     parent. The neighbor list caches it, so this is cheap unless a
+     neighbor's metric has changed. */
   best = libp_neighbour_list_best(&c->neighbour_list);
 
+  /* We grab the collect_neighbor struct of our current parent, which
+     usually is the best one. */
+  if(best != NULL && rimeaddr_cmp(&best->addr, &c->parent)) {
+    current = best;
+  } else {
+    current = libp_neighbour_list_find(&c->neighbour_list, &c->parent);
+  }
+
   /* We check if we need to switch parent. Switching parent is done in
      the following situations:
 
@@ -919,9 +2249,11 @@ static void update_parent(struct libp_conn *c)
      that is better, we employ a heuristic to avoid switching parents
      too often. The new parent must be significantly better than the
      current parent. Being "significantly better" is defined as having
-     an rtmetric that is has a difference of at least 1.5 times the
+     a parent cost that is has a difference of at least 1.5 times the
      COLLECT_LINK_ESTIMATE_UNIT. This is derived from the experience
-     by Gnawali et al (SenSys 2009). */
+     by Gnawali et al (SenSys 2009). The parent cost is the rtmetric
+     plus the link estimate plus a share for every child the parent
+     already supports, not counting ourselves. */
      if(best != NULL) {
     rimeaddr_t previous_parent;
 
@@ -934,15 +2266,17 @@ static void update_parent(struct libp_conn *c)
       PRINTF("update_parent: new parent %d.%d\n",
              best->addr.u8[0], best->addr.u8[1]);
       rimeaddr_copy(&c->parent, &best->addr);
-      stats.foundroute++;
+      c->parent_confirmed = 0;
+      c->stats.foundroute++;
+      stats_parent_changed(c);
       bump_advertisement(c);
     } else {
       if(DRAW_TREE) {
         PRINTF("#A e=%d\n", libp_neighbour_link_metric(best));
       }
-      if(libp_neighbour_rtmetric_link_metric(best) +
+      if(libp_neighbour_parent_cost(best, 0) +
          SIGNIFICANT_RTMETRIC_PARENT_CHANGE <
-         libp_neighbour_rtmetric_link_metric(current)) {
+         libp_neighbour_parent_cost(current, c->parent_confirmed)) {
 
         /* We switch parent. */
         PRINTF("update_parent: new parent %d.%d (%d) old parent %d.%d (%d)\n",
@@ -950,8 +2284,16 @@ static void update_parent(struct libp_conn *c)
                libp_neighbour_rtmetric(best),
                c->parent.u8[0], c->parent.u8[1],
                libp_neighbour_rtmetric(current));
+        /* Tell the old parent that it no longer needs to count us.
+           The packetbuf may be in use, so the notice is sent from a
+           timer. */
+        rimeaddr_copy(&c->removed_parent, &c->parent);
+        ctimer_set(&c->parent_removed_timer, 0, send_parent_removed, c);
+
         rimeaddr_copy(&c->parent, &best->addr);
-        stats.newparent++;
+        c->parent_confirmed = 0;
+        c->stats.newparent++;
+        stats_parent_changed(c);
         /* Since we now have a significantly better or worse rtmetric than
            we had before, we let our neighbors know this quickly. */
         bump_advertisement(c);
@@ -999,9 +2341,10 @@ static void update_parent(struct libp_conn *c)
       if(DRAW_TREE) {
         PRINTF("#L %d 0\n", c->parent.u8[0]);
       }
-      stats.routelost++;
+      c->stats.routelost++;
     }
     rimeaddr_copy(&c->parent, &rimeaddr_null);
+    c->parent_confirmed = 0;
   }
 
 }
@@ -1034,6 +2377,32 @@ rtmetric_compute(struct libp_conn *c)
   return rtmetric;
 }
 
+/**
+ * Called after the neighbor n has been updated, with how much its
+ * parent cost changed. Changes to neighbors that are neither our
+ * parent nor the best candidate cannot change our route, and small
+ * changes are accumulated until they are worth a recomputation.
+ */
+static void
+route_event(struct libp_conn *c, struct libp_neighbour *n, uint32_t delta)
+{
+  if(n == NULL || delta == 0) {
+    return;
+  }
+  if(delta < LIBP_NEIGHBOUR_BEST_CHANGED &&
+     !rimeaddr_cmp(&n->addr, &c->parent) &&
+     n != libp_neighbour_list_best(&c->neighbour_list)) {
+    return;
+  }
+  if(delta < LIBP_NEIGHBOUR_BEST_CHANGED &&
+     c->route_drift + delta < ROUTE_UPDATE_THRESHOLD) {
+    c->route_drift += delta;
+    return;
+  }
+  c->route_drift = 0;
+  update_rtmetric(c);
+}
+/*---------------------------------------------------------------------------*/
 /**
  * This function is called whenever there is a chance that the routing
  * metric has changed. The function goes through the list of neighbors
@@ -1064,10 +2433,24 @@ update_rtmetric(struct libp_conn *c)
         }
 
         c->rtmetric = new_rtmetric;
+        libp_neighbour_list_set_feasible(&c->neighbour_list, new_rtmetric);
+
+        /* A large change in our rtmetric is an inconsistency that our
+           neighbors should learn about quickly. */
+        if((new_rtmetric > old_rtmetric ? new_rtmetric - old_rtmetric :
+            old_rtmetric - new_rtmetric) >= SIGNIFICANT_RTMETRIC_PARENT_CHANGE) {
+            reset_beacon_timer(c);
+        }
 
-        if(c->is_router) {
+        if(c->is_router &&
+           (new_rtmetric == RTMETRIC_MAX ||
+            c->announced_rtmetric == RTMETRIC_MAX ||
+            (new_rtmetric > c->announced_rtmetric ?
+             new_rtmetric - c->announced_rtmetric :
+             c->announced_rtmetric - new_rtmetric) >= ROUTE_UPDATE_THRESHOLD)) {
             /* we update the rtmetric:value announcement */
             announcement_set_value(&c->announcement, c->rtmetric);
+            c->announced_rtmetric = c->rtmetric;
         }
         PRINTF("%d.%d: new rtmetric %d\n",
            rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
@@ -1086,16 +2469,17 @@ update_rtmetric(struct libp_conn *c)
 static void
 send_queued_packet(struct libp_conn *c)
 {
-    struct queuebuf *q;
     struct libp_neighbour *n;
     struct packetqueue_item *i;
-    struct data_msg_hdr hdr;
-    int max_mac_rexmits;
-
-     /* If we are currently sending a packet, we do not attempt to send
-     another one. */
-    if(c->sending) {
-        PRINTF("%d.%d: queue, c is sending\n",
+    struct libp_window_slot *s;
+    struct queue_key key;
+    int k;
+
+    /* If the send window is full, we do not attempt to send another
+       packet until one of the outstanding packets is ACKed or timed
+       out. */
+    if(c->sending >= LIBP_WINDOW_SIZE) {
+        PRINTF("%d.%d: queue, send window is full\n",
             rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1]);
         return;
     }
@@ -1108,95 +2492,129 @@ send_queued_packet(struct libp_conn *c)
         return;
     }
 
-    /* We should send the first packet from the queue. */
-  q = packetqueue_queuebuf(i);
-  if(q != NULL) {
-    /* Place the queued packet into the packetbuf. */
-    queuebuf_to_packetbuf(q);
-
-    /* Pick the neighbor to which to send the packet. We use the
+    /* Pick the neighbor to which to send the packets. We use the
        parent in the n->parent. */
     n = libp_neighbour_list_find(&c->neighbour_list, &c->parent);
+    if(n == NULL) {
+        return;
+    }
 
-    if(n != NULL) {
+    /* Remember the parent that we sent the packets to. */
+    rimeaddr_copy(&c->current_parent, &c->parent);
 
-      /* If the connection had a neighbor, we construct the packet
-         buffer attributes and set the appropriate flags in the
-         Collect connection structure and send the packet. */
+    /* Fill the free window slots with the first packets on the queue
+       that are not already outstanding. */
+    for(; i != NULL && c->sending < LIBP_WINDOW_SIZE; i = list_item_next(i)) {
+      if(window_holding(c, i) != NULL || packetqueue_queuebuf(i) == NULL) {
+        continue;
+      }
 
-      PRINTF("%d.%d: sending packet to %d.%d with eseqno %d\n",
-	     rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
-	     n->addr.u8[0], n->addr.u8[1],
-             packetbuf_attr(PACKETBUF_ATTR_EPACKET_ID));
+      for(k = 0; c->window[k].item != NULL; k++);
+      s = &c->window[k];
 
-      /* Mark that we are currently sending a packet. */
-      c->sending = 1;
+      /* While the packet is outstanding, it is governed by its
+         retransmission budget and its deadline rather than by its
+         queue lifetime. */
+      queue_key(i, &key);
+      s->has_deadline = key.has_deadline;
+      s->deadline = key.deadline;
+      ctimer_stop(&i->lifetimer);
 
-      /* Remember the parent that we sent this packet to. */
-      rimeaddr_copy(&c->current_parent, &c->parent);
+      /* Mark that we are currently sending a packet. */
+      s->item = i;
+      c->sending++;
+      rimeaddr_copy(&s->to, &c->parent);
 
       /* This is the first time we transmit this packet, so set
-         transmissions to zero. */
-      c->transmissions = 0;
+         transmissions to zero and give it the next sequence number. */
+      s->transmissions = 0;
+      s->to_transmissions = 0;
+      s->retransmitted = 0;
+      s->rank = 0;
+      s->failures = 0;
+      /* Zero-length packets are probes. */
+      s->probe = queuebuf_datalen(packetqueue_queuebuf(i)) <=
+        sizeof(struct data_msg_hdr);
+      s->seqno = c->seqno;
+      c->seqno = (c->seqno + 1) % (1 << COLLECT_PACKET_ID_BITS);
 
       /* Remember that maximum amount of retransmissions we should
          make. This is stored inside a packet attribute in the packet
          on the send queue. */
-      c->max_rexmits = packetbuf_attr(PACKETBUF_ATTR_MAX_REXMIT);
-
-      /* Set the packet attributes: this packet wants an ACK, so we
-         sent the PACKETBUF_ATTR_RELIABLE flag; the MAC should retry
-         MAX_MAC_REXMITS times; and the PACKETBUF_ATTR_PACKET_ID is
-         set to the current sequence number on the connection. */
-      packetbuf_set_attr(PACKETBUF_ATTR_RELIABLE, 1);
-
-      max_mac_rexmits = c->max_rexmits > MAX_MAC_REXMITS?
-        MAX_MAC_REXMITS : c->max_rexmits;
-      packetbuf_set_attr(PACKETBUF_ATTR_MAX_MAC_TRANSMISSIONS, max_mac_rexmits);
-      packetbuf_set_attr(PACKETBUF_ATTR_PACKET_ID, c->seqno);
-
-      stats.datasent++;
-
-      /* Copy our rtmetric into the packet header of the outgoing
-         packet. */
-      memset(&hdr, 0, sizeof(hdr));
-      hdr.rtmetric = c->rtmetric;
-      memcpy(packetbuf_dataptr(), &hdr, sizeof(struct data_msg_hdr));
-
-      /* Send the packet. */
-      send_packet(c, n);
-
-    }
+      s->max_rexmits = queuebuf_attr(packetqueue_queuebuf(i),
+                                     PACKETBUF_ATTR_MAX_REXMIT);
 
+      c->stats.datasent++;
+      stats_hist_add(c->stats.sojourn_hist,
+                     (clock_time() - etimer_start_time(&i->lifetimer.etimer)) /
+                     (CLOCK_SECOND / 16 > 0 ? CLOCK_SECOND / 16 : 1));
 
+      transmit_slot(s, n);
     }
 }
 
 
-void libp_open(struct libp_conn *c, uint16_t channels, uint8_t is_router, const struct libp_callbacks *cb)
+void libp_open(struct libp_conn *c, uint16_t channels, uint8_t is_router,
+               const struct libp_pools *pools, const struct libp_callbacks *cb)
 {
+    int i;
+
+    if(pools == NULL) {
+        pools = &default_pools;
+    }
+
     unicast_open(&c->unicast_conn, channels + 1, &unicast_callbacks);
     broadcast_open(&c->broadcast_conn, channels - 1, &broadcast_call);
+    broadcast_open(&c->anycast_conn, channels + 2, &anycast_call);
     channel_set_attributes(channels + 1, attributes);
-    l = c;
+    channel_set_attributes(channels + 2, anycast_attributes);
     c->rtmetric = RTMETRIC_MAX;
     c->cb = cb;
     c->is_router = is_router;
     c->is_sink = 0;
     c->seqno = 10;
     c->eseqno = 0;
+    c->beacon_period = REBROADCAST_TIME * CLOCK_SECOND;
+    c->beacon_interval = 0;
+    c->parent_confirmed = 0;
+    c->opportunistic = 0;
+    c->parent_change_time = 0;
+    c->parent_congestion = 0;
+    timer_set(&c->parent_congestion_timer, 0);
+    c->tokens = TOKEN_BUCKET_DEPTH;
+    c->token_time = clock_time();
+    libp_reset_stats(c);
+    for(i = 0; i < LIBP_MAX_CHILDREN; i++) {
+        rimeaddr_copy(&c->children[i].addr, &rimeaddr_null);
+    }
+    for(i = 0; i < LIBP_WINDOW_SIZE; i++) {
+        c->window[i].c = c;
+    }
+    window_clear(c);
     LIST_STRUCT_INIT(c, send_queue_list);
-    libp_neighbour_list_new(&c->neighbour_list);
+    libp_neighbour_list_new(&c->neighbour_list, pools->neighbour_memb);
     c->send_queue.list = &(c->send_queue_list);
-    c->send_queue.memb = &send_queue_memb;
-    libp_neighbour_init();
+    c->send_queue.memb = pools->send_queue_memb;
+    c->seqno_table = pools->seqno_table;
+    c->seqno_table_size = pools->seqno_table_size;
+    /* Forget what an earlier connection at this address remembered. */
+    for(i = 0; i < c->seqno_table_size; i++) {
+        if(c->seqno_table[i].conn == c) {
+            c->seqno_table[i].conn = NULL;
+        }
+    }
 
     announcement_register(&c->announcement, channels, received_announcement);
+    c->announced_rtmetric = RTMETRIC_MAX;
+    c->route_drift = 0;
     if(c->is_router) {
         announcement_set_value(&c->announcement, RTMETRIC_MAX);
     }
 
-    ctimer_set(&c->proactive_probing_timer, PROACTIVE_PROBING_INTERVAL, proactive_probing_callback, c);
+    c->probe_backoff = 0;
+    c->probe_transmissions = 0;
+    c->probe_budget_start = clock_seconds();
+    set_probing_timer(c);
 }
 void libp_close(struct libp_conn *c)
 {
@@ -1205,32 +2623,46 @@ void libp_close(struct libp_conn *c)
     unicast_close(&c->unicast_conn);
 
     broadcast_close(&c->broadcast_conn);
+    broadcast_close(&c->anycast_conn);
+    ctimer_stop(&c->beacon_timer);
+    ctimer_stop(&c->parent_removed_timer);
+    ctimer_stop(&c->proactive_probing_timer);
+    c->beacon_interval = 0;
 
+    window_clear(c);
     while(packetqueue_first(&c->send_queue) != NULL) {
     packetqueue_dequeue(&c->send_queue);
   }
+
+    /* The neighbours go back to the connection's pool, which
+       libp_open() does not free. */
+    libp_neighbour_list_purge(&c->neighbour_list);
 }
 
-int libp_send(struct libp_conn *c, int rexmits)
+int libp_send(struct libp_conn *c, int rexmits, uint8_t tclass,
+              clock_time_t deadline)
 {
     struct libp_neighbour *n;
+    struct packetqueue_item *i;
+    struct data_msg_hdr hdr;
+    clock_time_t wait;
     int ret;
 
-    packetbuf_set_attr(PACKETBUF_ATTR_EPACKET_ID, c->eseqno);
-
-  /* Increase the sequence number for the packet we send out. We
-     employ a trick that allows us to see that a node has been
-     rebooted: if the sequence number wraps to 0, we set it to half of
-     the sequence number space. This allows us to detect reboots,
-     since if a sequence number is less than half of the sequence
-     number space, the data comes from a node that was recently
-     rebooted. */
+    /* Hold back the source while the path to the sink is congested,
+       rather than having the packet dropped further up the tree. */
+    if(c->rtmetric != RTMETRIC_SINK &&
+       (wait = admit_packet(c, tclass)) != 0) {
+        PRINTF("%d.%d: throttled, wait %lu\n",
+               rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+               (unsigned long)wait);
+        if(c->cb->throttled != NULL) {
+            c->cb->throttled(congestion_level(c), wait);
+        }
+        return 0;
+    }
 
-    c->eseqno = (c->eseqno + 1) % (1 << COLLECT_PACKET_ID_BITS);
+    packetbuf_set_attr(PACKETBUF_ATTR_EPACKET_ID, allocate_eseqno(c));
 
-    if(c->eseqno == 0) {
-    c->eseqno = ((int)(1 << COLLECT_PACKET_ID_BITS)) / 2;
-  }
   packetbuf_set_addr(PACKETBUF_ADDR_ESENDER, &rimeaddr_node_addr);
   packetbuf_set_attr(PACKETBUF_ATTR_HOPS, 1);
   packetbuf_set_attr(PACKETBUF_ATTR_TTL, MAX_HOPLIM);
@@ -1255,13 +2687,25 @@ int libp_send(struct libp_conn *c, int rexmits)
     return 1;
   } else {
 
-    /* Allocate space for the header. */
+    /* Allocate space for the header, which carries the traffic class
+       and the deadline of the packet. */
     packetbuf_hdralloc(sizeof(struct data_msg_hdr));
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.tclass = tclass;
+    /* The header has 16 bits for the deadline, and 0 means none. */
+    if(deadline > 0xffff) {
+      hdr.deadline = 0xffff;
+    } else {
+      hdr.deadline = deadline;
+    }
+    memcpy(packetbuf_hdrptr(), &hdr, sizeof(struct data_msg_hdr));
 
-    if(packetqueue_enqueue_packetbuf(&c->send_queue,
-                                     FORWARD_PACKET_LIFETIME_BASE *
-                                     packetbuf_attr(PACKETBUF_ATTR_MAX_REXMIT),
-                                     c)) {
+    i = enqueue_packetbuf(c, &hdr);
+    if(i == NULL && make_room(c, tclass)) {
+      i = enqueue_packetbuf(c, &hdr);
+    }
+    if(i != NULL) {
+      aggregate_queued_packet(c, i);
       send_queued_packet(c);
       ret = 1;
     } else {
@@ -1299,23 +2743,29 @@ void libp_set_sink(struct libp_conn *c, int should_be_sink)
         PRINTF("collect_set_sink: c->rtmetric %d\n", c->rtmetric);
         bump_advertisement(c);
 
-        /* Purge the outgoing packet queue. */
+        /* Stop the retransmission timers and purge the outgoing
+           packet queue. */
+        window_clear(c);
         while(packetqueue_len(&c->send_queue) > 0) {
             packetqueue_dequeue(&c->send_queue);
         }
-
-    /* Stop the retransmission timer. */
-    ctimer_stop(&c->retransmission_timer);
   } else {
     c->rtmetric = RTMETRIC_MAX;
   }
 
   announcement_set_value(&c->announcement, c->rtmetric);
+  c->announced_rtmetric = c->rtmetric;
 
   update_rtmetric(c);
 
   bump_advertisement(c);
 }
+/*---------------------------------------------------------------------------*/
+void
+libp_set_opportunistic(struct libp_conn *c, int on)
+{
+  c->opportunistic = on != 0;
+}
 
 const rimeaddr_t *
 libp_parent(struct libp_conn *c)
@@ -1341,5 +2791,66 @@ int get_libp_metric(struct libp_conn *c)
     parent = libp_neighbour_list_find(&c->neighbour_list, &c->current_parent);
     if(parent == NULL)
         return 0;
-    return parent->lm.num_estimates;
+    return libp_link_metric_num_metrics(&parent->lm);
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_get_stats(struct libp_conn *c, struct libp_stats *s)
+{
+  memcpy(s, &c->stats, sizeof(struct libp_stats));
+}
+/*---------------------------------------------------------------------------*/
+void
+libp_reset_stats(struct libp_conn *c)
+{
+  memset(&c->stats, 0, sizeof(struct libp_stats));
+}
+/*---------------------------------------------------------------------------*/
+static int
+stats_encode_varint(uint8_t *buf, int len, int maxlen, uint32_t value)
+{
+  do {
+    if(len >= maxlen) {
+      return -1;
+    }
+    buf[len] = value & 0x7f;
+    value >>= 7;
+    if(value != 0) {
+      buf[len] |= 0x80;
+    }
+    len++;
+  } while(value != 0);
+  return len;
+}
+/*---------------------------------------------------------------------------*/
+int
+libp_stats_encode(const struct libp_stats *s, uint8_t *buf, int maxlen)
+{
+  const uint32_t counters[] = {
+    s->foundroute, s->newparent, s->routelost,
+    s->acksent, s->datasent,
+    s->datarecv, s->ackrecv, s->badack, s->duprecv,
+    s->qdrop, s->rtdrop, s->ttldrop, s->ackdrop, s->timedout,
+    s->aggregated, s->deadlinedrop,
+  };
+  const uint16_t *hists[] = {
+    s->tx_hist, s->queue_hist, s->sojourn_hist, s->parent_hist,
+  };
+  int len, i, b;
+
+  if(maxlen < 1) {
+    return 0;
+  }
+  buf[0] = LIBP_STATS_VERSION;
+  len = 1;
+  for(i = 0; i < sizeof(counters) / sizeof(counters[0]) && len >= 0; i++) {
+    len = stats_encode_varint(buf, len, maxlen, counters[i]);
+  }
+  for(i = 0; i < sizeof(hists) / sizeof(hists[0]) && len >= 0; i++) {
+    for(b = 0; b < LIBP_STATS_BUCKETS && len >= 0; b++) {
+      len = stats_encode_varint(buf, len, maxlen, hists[i][b]);
+    }
+  }
+  return len < 0 ? 0 : len;
 }
+/*---------------------------------------------------------------------------*/
@@ -15,38 +15,189 @@
 #include "net/packetqueue.h"
 #include "sys/ctimer.h"
 #include "lib/list.h"
+#include "lib/memb.h"
 
 struct libp_callbacks {
   void (* recv)(const rimeaddr_t *originator, uint8_t seqno,
 		uint8_t hops);
+  /* Called when libp_send() refuses a packet because the path to the
+     sink is congested. The level is the congestion level of the path
+     and wait the time until a packet will be accepted again. */
+  void (* throttled)(uint8_t level, clock_time_t wait);
+};
+
+/* Congestion is graded in LIBP_CONGESTION_LEVELS levels, from 0 for
+   no congestion up to LIBP_CONGESTION_LEVELS - 1 for a full send
+   queue. */
+#define LIBP_CONGESTION_LEVELS 8
+
+/* The number of packets a connection may have outstanding towards its
+   parent at the same time. Each packet in the window is identified by
+   its own PACKETBUF_ATTR_PACKET_ID and is acknowledged and
+   retransmitted independently of the others. A window of 1 gives the
+   classic stop-and-wait behaviour. */
+#ifdef LIBP_CONF_WINDOW_SIZE
+#define LIBP_WINDOW_SIZE LIBP_CONF_WINDOW_SIZE
+#else /* LIBP_CONF_WINDOW_SIZE */
+#define LIBP_WINDOW_SIZE 4
+#endif /* LIBP_CONF_WINDOW_SIZE */
+
+/* The number of children a router keeps track of. Children register
+   by setting the parent chosen flag in their data packets and are
+   forgotten when they say so or when they have been silent for too
+   long. */
+#ifdef LIBP_CONF_MAX_CHILDREN
+#define LIBP_MAX_CHILDREN LIBP_CONF_MAX_CHILDREN
+#else /* LIBP_CONF_MAX_CHILDREN */
+#define LIBP_MAX_CHILDREN 8
+#endif /* LIBP_CONF_MAX_CHILDREN */
+
+struct libp_conn;
+
+/* The number of buckets in each of the statistics histograms. Bucket 0
+   counts the value 0 and bucket i counts values from 2^(i-1) up to
+   2^i - 1; the last bucket also counts everything larger. */
+#define LIBP_STATS_BUCKETS 8
+
+struct libp_stats {
+  uint32_t foundroute;
+  uint32_t newparent;
+  uint32_t routelost;
+
+  uint32_t acksent;
+  uint32_t datasent;
+
+  uint32_t datarecv;
+  uint32_t ackrecv;
+  uint32_t badack;
+  uint32_t duprecv;
+
+  uint32_t qdrop;
+  uint32_t rtdrop;
+  uint32_t ttldrop;
+  uint32_t ackdrop;
+  uint32_t timedout;
+
+  uint32_t aggregated;
+  uint32_t deadlinedrop;
+
+  /* Transmissions needed for every packet our parent ACKed. */
+  uint16_t tx_hist[LIBP_STATS_BUCKETS];
+  /* The send queue length seen by every packet that was queued. */
+  uint16_t queue_hist[LIBP_STATS_BUCKETS];
+  /* The time packets waited on the send queue before their first
+     transmission, in units of CLOCK_SECOND / 16. */
+  uint16_t sojourn_hist[LIBP_STATS_BUCKETS];
+  /* The time between parent changes, in units of 16 seconds. */
+  uint16_t parent_hist[LIBP_STATS_BUCKETS];
+};
+
+/* An entry in the duplicate cache: the window of sequence numbers
+   recently seen from one originator. */
+struct libp_seqno_entry {
+  struct libp_conn *conn;
+  rimeaddr_t originator;
+  uint8_t last;
+  uint8_t stamp;
+  uint32_t seen;
+};
+
+/* The memory a connection uses for its send queue and its duplicate
+   cache, and for its neighbour table.
+   LIBP_POOLS(name, queuelen, dupentries, neighbours) declares a set of
+   pools that is handed to libp_open(). Each connection should have its
+   own pools; connections opened with NULL pools share a default set. */
+struct libp_pools {
+  struct memb *send_queue_memb;
+  struct memb *neighbour_memb;
+  struct libp_seqno_entry *seqno_table;
+  uint8_t seqno_table_size;
+};
+
+#define LIBP_POOLS(name, queuelen, dupentries, neighbours)              \
+  MEMB(name##_send_queue_memb, struct packetqueue_item, queuelen);      \
+  MEMB(name##_neighbour_memb, struct libp_neighbour, neighbours);       \
+  static struct libp_seqno_entry name##_seqno_table[dupentries];        \
+  static const struct libp_pools name = { &name##_send_queue_memb,      \
+                                          &name##_neighbour_memb,       \
+                                          name##_seqno_table,           \
+                                          dupentries }
+
+struct libp_child {
+  rimeaddr_t addr;
+  uint16_t last_heard;
+};
+
+struct libp_window_slot {
+  struct libp_conn *c;
+  struct packetqueue_item *item;
+  struct ctimer retransmission_timer;
+  rimeaddr_t to;
+  clock_time_t send_time;
+  clock_time_t deadline;
+  uint8_t has_deadline;
+  uint8_t retransmitted;
+  uint8_t anycast;
+  /* A proactive probe, which stays with the neighbor it probes. */
+  uint8_t probe;
+  /* 0 while the packet goes to the parent, otherwise 1 + the rank of
+     the backup parent it failed over to. */
+  uint8_t rank;
+  uint8_t failures;
+  uint8_t seqno;
+  uint8_t transmissions, max_rexmits;
+  /* The transmissions made to the neighbour in to, which are the
+     ones its link estimate is charged for. */
+  uint8_t to_transmissions;
 };
 
 struct libp_conn {
   struct unicast_conn unicast_conn;
   struct broadcast_conn broadcast_conn;
+  struct broadcast_conn anycast_conn;
   struct announcement announcement;
   struct ctimer transmit_after_scan_timer;
   const struct libp_callbacks *cb;
-  struct ctimer retransmission_timer;
+  struct libp_window_slot window[LIBP_WINDOW_SIZE];
   LIST_STRUCT(send_queue_list);
   struct packetqueue send_queue;
+  struct libp_seqno_entry *seqno_table;
+  uint8_t seqno_table_size;
   struct libp_neighbour_list neighbour_list;
+  struct libp_stats stats;
+  unsigned long parent_change_time;
+
+  struct timer parent_congestion_timer;
+  clock_time_t token_time;
+  uint8_t parent_congestion;
+  uint8_t tokens;
 
   struct ctimer beacon_timer;
   clock_time_t beacon_period;
+  clock_time_t beacon_interval, beacon_fire_time;
+  uint8_t beacon_counter, beacon_fired;
 
 
   struct ctimer proactive_probing_timer;
+  unsigned long probe_budget_start;
+  uint16_t probe_transmissions;
+  uint8_t probe_backoff;
+
+  struct libp_child children[LIBP_MAX_CHILDREN];
+  struct ctimer parent_removed_timer;
+  rimeaddr_t removed_parent;
 
   rimeaddr_t parent, current_parent;
-  uint16_t rtmetric;
+  uint16_t rtmetric, announced_rtmetric;
+  uint16_t route_drift;
   uint8_t seqno;
-  uint8_t sending, transmissions, max_rexmits;
+  uint8_t beacon_seqno;
+  uint8_t sending;
   uint8_t eseqno;
   uint8_t is_router;
   uint8_t is_sink;
-
-  clock_time_t send_time;
+  uint8_t parent_confirmed;
+  uint8_t opportunistic;
 };
 
 enum {
@@ -54,18 +205,115 @@ enum {
   LIBP_ROUTER,
 };
 
+/* Traffic classes. The send queue is served in order of decreasing
+   class, and within a class in order of earliest deadline. */
+enum {
+  LIBP_CLASS_ROUTINE,
+  LIBP_CLASS_PRIORITY,
+  LIBP_CLASS_ALARM,
+};
+
+/**
+ * \brief      Open a LIBP connection
+ * \param c    The LIBP connection
+ * \param channels The connection uses the Rime channels from channels - 1
+ *             up to channels + 2
+ * \param is_router LIBP_ROUTER if the node forwards packets for others
+ * \param pools The send queue, duplicate cache and neighbour table
+ *             memory, declared with LIBP_POOLS(), or NULL for the
+ *             default pools
+ * \param callbacks The callbacks of the connection
+ *
+ *             Several connections may be open at the same time as
+ *             long as they use different channels.
+ */
 void libp_open(struct libp_conn *c, uint16_t channels,
                   uint8_t is_router,
+                  const struct libp_pools *pools,
                   const struct libp_callbacks *callbacks);
 void libp_close(struct libp_conn *c);
 
-int libp_send(struct libp_conn *c, int rexmits);
+/**
+ * \brief      Send the packet in the packetbuf towards the sink
+ * \param c    The LIBP connection
+ * \param rexmits The maximum number of transmissions per hop
+ * \param tclass The traffic class of the packet, one of LIBP_CLASS_*
+ * \param deadline The time within which the packet should reach the
+ *             sink, in clock ticks, or 0 for no deadline. Deadlines are
+ *             capped at 0xffff ticks
+ * \return     Non-zero if the packet could be queued
+ *
+ *             Packets whose deadline passes before they have reached
+ *             the sink are dropped along the way. While the path to
+ *             the sink is congested, packets are admitted at a rate
+ *             that decreases with the congestion level, and the
+ *             throttled callback is called for packets that are
+ *             refused. Alarms are always admitted.
+ */
+int libp_send(struct libp_conn *c, int rexmits, uint8_t tclass,
+              clock_time_t deadline);
 
 void libp_set_sink(struct libp_conn *c, int should_be_sink);
 
+/**
+ * \brief      Turn opportunistic forwarding on or off
+ * \param c    The LIBP connection
+ * \param on   Non-zero to send data packets to a set of candidates
+ *
+ *             In opportunistic mode, data packets are sent to the
+ *             parent and the ranked backup parents at the same time,
+ *             and any of them that is closer to the sink may take the
+ *             packet and ACK it. This saves transmissions on lossy
+ *             links. Copies taken by more than one candidate are
+ *             removed by duplicate suppression where their paths
+ *             meet. To keep the copies recognisable, a packet that
+ *             has been sent as anycast is never aggregated again on
+ *             its way to the sink.
+ */
+void libp_set_opportunistic(struct libp_conn *c, int on);
+
+/**
+ * \brief      Set the shortest beacon interval
+ * \param c    The LIBP connection
+ * \param period The interval used after the routing state has changed,
+ *             or 0 to stop beaconing
+ *
+ *             Beacons are scheduled with a Trickle timer: the interval
+ *             doubles up to period << LIBP_BEACON_DOUBLINGS while the
+ *             neighbourhood is consistent, and falls back to period
+ *             when the parent or the routing metric changes.
+ */
 void libp_set_beacon_period(struct libp_conn *c, clock_time_t period);
 
-/*void libp_print_stats(void);*/
+/**
+ * \brief      Get a snapshot of the statistics of a connection
+ * \param c    The LIBP connection
+ * \param s    Where to copy the statistics
+ */
+void libp_get_stats(struct libp_conn *c, struct libp_stats *s);
+
+/**
+ * \brief      Clear the statistics of a connection
+ * \param c    The LIBP connection
+ */
+void libp_reset_stats(struct libp_conn *c);
+
+/**
+ * \brief      Encode statistics for sending them to the sink
+ * \param s    The statistics
+ * \param buf  The buffer to encode into
+ * \param maxlen The size of the buffer
+ * \return     The length of the encoding, or 0 if it does not fit
+ *
+ *             The encoding is a version byte (LIBP_STATS_VERSION)
+ *             followed by every field of struct libp_stats, in
+ *             declaration order and histograms bucket by bucket, as
+ *             unsigned LEB128 varints. Most fields are small, so the
+ *             encoding usually fits in a single packet.
+ */
+int libp_stats_encode(const struct libp_stats *s, uint8_t *buf, int maxlen);
+
+#define LIBP_STATS_VERSION 1
 
 #define LIBP_MAX_DEPTH (LIBP_LINK_METRIC_UNIT * 64 - 1)
 
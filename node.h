@@ -9,21 +9,49 @@
 #ifndef NODE_H
 #define NODE_H
 
+/* Nodes live in a contiguous arena and refer to each other by their
+   index in it. NODE_NONE stands for no node. The parent of a removed
+   node, whose slot is on the free list, is NODE_FREE. */
+#define NODE_NONE -1
+#define NODE_FREE -2
+
 /**
  * \struct Node
  * \properties:
- *	id - identity
+ *	id - identity, the rime address of the node
  *      metric - node weight
- *      firstchild - the first child of the node/vertex
- *      nextsibling - the immediate sibling of the node/vertex
+ *      parent - the index of the parent of the node/vertex, NODE_NONE for the root and placeholders
+ *      firstchild - the index of the first child of the node/vertex
+ *      lastchild - the index of the last child of the node/vertex
+ *      prevsibling - the index of the previous sibling of the node/vertex
+ *      nextsibling - the index of the immediate sibling of the node/vertex
+ *      visited - the order in which the last search visited the node, 0 if not visited
+ *      advertised - the children weight the node advertised
+ *      calculated - the children weight calculated by the bfs
+ *      children - the number of direct children
+ *      descendants - the number of nodes in the subtree, not counting the node itself
+ *      load - the traffic load the node itself generates
+ *      subtree_load - the traffic load of the node and its whole subtree
+ *      heappos - the position of the node in the busiest node heap of the tree
  */
 
 struct Node
 {
     int id;
     int metric;
-    struct Node *firstchild;
-    struct Node *nextsibling;
+    int parent;
+    int firstchild;
+    int lastchild;
+    int prevsibling;
+    int nextsibling;
+    int visited;
+    int advertised;
+    int calculated;
+    int children;
+    int descendants;
+    int load;
+    int subtree_load;
+    int heappos;
 };
 
 #endif
@@ -5,91 +5,71 @@
  *         Lutando Ngqakaza <lutando.ngqakaza@gmail.com>
  */
 #include <stdio.h>
-#include <stdlib.h>
 
 #include "queue.h"
-#include "node.h"
 
 
-void queue_init()
+void queue_init(struct queue *q, int *storage, int capacity)
 {
-    elements = 0;
-    head = NULL;
-    tail = NULL;
+    q->items = storage;
+    q->capacity = capacity;
+    q->head = 0;
+    q->size = 0;
 }
 
 
-void queue_push(struct Node * node)
+int queue_push(struct queue *q, int item)
 {
-    struct Item *i;
-    i = (struct Item *)malloc(sizeof(struct Item));
-    i->node = node;
-    i->next = NULL;
+    int tail;
 
-    if(tail == NULL)
+    if(q->size >= q->capacity)
     {
-        tail = i;
+        return 0;
     }
-    else
+    tail = q->head + q->size;
+    if(tail >= q->capacity)
     {
-
-        //tail->next = i;
-        tail->next = i;
-        tail = i;
-    }
-    if(head == NULL)
-    {
-        head = i;
+        tail -= q->capacity;
     }
-    //printf("node %d pushed onto q\n",node->id);
-    elements = elements + 1;
-
+    q->items[tail] = item;
+    q->size = q->size + 1;
+    //printf("item %d pushed onto q\n",item);
+    return 1;
 }
 
-void print_queue()
+void print_queue(struct queue *q)
 {
-    struct Item *tmp = head;
-    while(tmp)
+    int k;
+    for(k = 0; k < q->size; k++)
     {
-        printf("-%d-\n",tmp->node->id);
-        tmp = tmp->next;
+        printf("-%d-\n", q->items[(q->head + k) % q->capacity]);
     }
 }
 
-int queue_dequeue()
+int queue_dequeue(struct queue *q)
 {
-    //print_queue();
-    struct Item *tmp = head;
     int ret;
-    ret = head->node->id;
 
-    head = head->next;
-    free(tmp);
-    elements = elements - 1;
+    ret = q->items[q->head];
+    q->head = q->head + 1;
+    if(q->head == q->capacity)
+    {
+        q->head = 0;
+    }
+    q->size = q->size - 1;
     return ret;
-
 }
 
-int queue_getSize()
+int queue_getSize(struct queue *q)
 {
-    return elements;
+    return q->size;
 }
 
-int queue_empty()
+int queue_empty(struct queue *q)
 {
-    if(elements < 1)
+    if(q->size < 1)
     {
         return 1;
     }
     return 0;
 }
-
-struct Item * get_head()
-{
-    return head;
-}
-
-struct Item * get_tail()
-{
-    return tail;
-}
@@ -8,66 +8,67 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
-#include "node.h"
-
 /**
- * \struct Item
+ * \struct queue
  * \properties:
- *	node - the node
- *      metric - next item attached to this node
+ *	items - the ring buffer, owned by the caller
+ *      capacity - the number of items the ring buffer holds
+ *      head - the index of the head of the queue in the ring buffer
+ *      size - the number of items on the queue
+ *
+ *      A queue of ints, such as indices of nodes, that does no allocation of
+ *      its own. Every queue has its own state, so several may be used at once.
  */
 
-struct Item
+struct queue
 {
-    struct Node *node;
-    struct Item *next;
+    int *items;
+    int capacity;
+    int head;
+    int size;
 };
 
-struct Item *head; //holds the head of the queue
-struct Item *tail; //holds the tail of the queue
-int elements; //holds the queue size
-
 /**
  * \brief      Initialize the queue
+ * \param q    The queue
+ * \param storage The ring buffer, with room for capacity items
+ * \param capacity The size of the ring buffer
  *
- *             This function initializes the queue
+ *             This function initializes an empty queue on top of storage
  */
-void queue_init();
+void queue_init(struct queue *q, int *storage, int capacity);
 
 /**
- * \brief      adds node to queue
- * \param node The node that needs to be pushed into the back of the queue
+ * \brief      adds an item to queue
+ * \param q    The queue
+ * \param item The item that needs to be pushed into the back of the queue
+ * \returns    1 if the item was added, 0 if the queue is full
  *
- *	       The node is added to the back of the queue and the tail is set accordingly
+ *	       The item is added to the back of the queue
  */
-void queue_push(struct Node * node);
+int queue_push(struct queue *q, int item);
 
 /**
  * \brief      Dequeues the queue
+ * \param q    The queue, which must not be empty
  * \returns    The head of the queue.
  *             This function pops the top off the queue
  */
-int queue_dequeue();
+int queue_dequeue(struct queue *q);
 
 /**
  * \brief      Getter for queue size
+ * \param q    The queue
  * \returns    The size of the queue
  *             This function returns the size of the queue
  */
-int queue_getSize();
-
-/**
- * \brief      Getter for queue head
- * \returns    The queue head
- *             This function returns the head node of the queue
- */
-struct Item * get_head();
+int queue_getSize(struct queue *q);
 
 /**
- * \brief      Getter for queue tail
- * \returns    The queue head
- *             This function returns the head node of the tails
+ * \brief      Checks whether the queue is empty
+ * \param q    The queue
+ * \returns    1 if the queue is empty, 0 otherwise
  */
-struct Item * get_tail();
+int queue_empty(struct queue *q);
 
 #endif
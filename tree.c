@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "tree.h"
 #include "node.h"
@@ -24,240 +25,573 @@ then run bfs_tree(v) to do a bfs to get a supporting children count
 
 */
 
+#define INITIAL_NODES 16
 
+//multiplicative hashing, taking the top bits of the product since the low bits
+//only depend on the low bits of the id, and rime addresses differ in the high byte
+static int hash_slot(struct libp_tree *t, int id)
+{
+    return ((unsigned int)id * 2654435761u) >> t->slot_shift;
+}
 
+//returns the slot that holds id, or the empty slot where it would go
+static int index_lookup(struct libp_tree *t, int id)
+{
+    int s = hash_slot(t, id);
+    while(t->index_slots[s] != NODE_NONE && t->nodes[t->index_slots[s]].id != id)
+    {
+        s = (s + 1) & (t->num_slots - 1);
+    }
+    return s;
+}
 
+static int index_resize(struct libp_tree *t, int slots)
+{
+    int *new_slots;
+    int k;
+
+    new_slots = (int *)malloc(slots * sizeof(int));
+    if(new_slots == NULL)
+    {
+        return 0;
+    }
+    free(t->index_slots);
+    t->index_slots = new_slots;
+    t->num_slots = slots;
+    t->slot_shift = 32;
+    while((1 << (32 - t->slot_shift)) < slots)
+    {
+        t->slot_shift--;
+    }
+    for(k = 0; k < t->num_slots; k++)
+    {
+        t->index_slots[k] = NODE_NONE;
+    }
+    for(k = 0; k < t->num_nodes; k++)
+    {
+        t->index_slots[index_lookup(t, t->nodes[k].id)] = k;
+    }
+    return 1;
+}
 
-void init_visited()
+//makes room for one more node, doubling the arena and the index when full
+static int arena_grow(struct libp_tree *t)
 {
-    int k = 0;
-    for(k = 0; k <128; k++)
+    struct Node *new_nodes;
+    int *new_items;
+    int new_max;
+
+    if(t->num_nodes < t->max_nodes)
+    {
+        return 1;
+    }
+    new_max = t->max_nodes > 0 ? t->max_nodes * 2 : INITIAL_NODES;
+    new_nodes = (struct Node *)realloc(t->nodes, new_max * sizeof(struct Node));
+    if(new_nodes == NULL)
+    {
+        return 0;
+    }
+    t->nodes = new_nodes;
+    new_items = (int *)realloc(t->bfs_items, new_max * sizeof(int));
+    if(new_items == NULL)
+    {
+        return 0;
+    }
+    t->bfs_items = new_items;
+    new_items = (int *)realloc(t->heap, new_max * sizeof(int));
+    if(new_items == NULL)
     {
-        visited[k] = 0;
+        return 0;
     }
+    t->heap = new_items;
+    if(!index_resize(t, 2 * new_max))
+    {
+        return 0;
+    }
+    t->max_nodes = new_max;
+    return 1;
 }
 
-void bfs(struct Node * v)
+//returns the arena index of the node with id, or NODE_NONE
+static int node_index(struct libp_tree *t, int id)
 {
-    queue_init();
-    queue_push(v);
-    bfs_count = bfs_count + 1;
-    visited[v->id] = bfs_count;
-    int queue_size = queue_getSize();
-    while(queue_size > 0)
+    if(t->num_slots == 0)
     {
-        //get all children incident to parent
-        int kids;
-        kids = 0;
-        int id = queue_dequeue();
-        struct Node *c = nodes[id]->firstchild;
+        return NODE_NONE;
+    }
+    return t->index_slots[index_lookup(t, id)];
+}
+
+//the load node i forwards for its subtree
+static int forwarded(struct libp_tree *t, int i)
+{
+    return t->nodes[i].subtree_load - t->nodes[i].load;
+}
 
-        while(c != NULL)
+static void heap_set(struct libp_tree *t, int pos, int i)
+{
+    t->heap[pos] = i;
+    t->nodes[i].heappos = pos;
+}
+
+//moves node i towards the top of the heap while it forwards more than its parent in the heap
+static void heap_up(struct libp_tree *t, int i)
+{
+    int pos = t->nodes[i].heappos;
+    int up;
+
+    while(pos > 0)
+    {
+        up = (pos - 1) / 2;
+        if(forwarded(t, t->heap[up]) >= forwarded(t, i))
         {
-            if(visited[c->id] == 0);
-            {
-                bfs_count = bfs_count + 1;
-                visited[c->id] = bfs_count;
-                queue_push(c);
-                kids++;
-            }
-            struct Node *tmp = c;
-            c = tmp->nextsibling;
+            break;
         }
-        //printf("Number of kids for Node %d is %d\n",id,kids);
-        calculated[id] = kids;
-        queue_size = queue_getSize();
-        //free(dq);
+        heap_set(t, pos, t->heap[up]);
+        pos = up;
     }
+    heap_set(t, pos, i);
 }
 
-void tree_bfs()
+//moves node i towards the bottom of the heap while a child in the heap forwards more
+static void heap_down(struct libp_tree *t, int i)
 {
-    bfs_count = 0;
-    init_visited();
-    int k;
-    for(k = 0; k < 128; k++)
+    int pos = t->nodes[i].heappos;
+    int down;
+
+    while((down = 2 * pos + 1) < t->heap_size)
     {
-        if(nodes[k] != NULL)
+        if(down + 1 < t->heap_size &&
+           forwarded(t, t->heap[down + 1]) > forwarded(t, t->heap[down]))
         {
-            if(visited[k] == 0)
-            {
-                bfs(nodes[k]);
-            }
+            down++;
         }
+        if(forwarded(t, t->heap[down]) <= forwarded(t, i))
+        {
+            break;
+        }
+        heap_set(t, pos, t->heap[down]);
+        pos = down;
     }
+    heap_set(t, pos, i);
+}
 
+static void heap_remove(struct libp_tree *t, int i)
+{
+    int last = t->heap[--t->heap_size];
 
+    if(last != i)
+    {
+        heap_set(t, t->nodes[i].heappos, last);
+        heap_up(t, last);
+        heap_down(t, last);
+    }
 }
 
-void tree_init()
+//adds a detached node with id, returns its arena index or NODE_NONE
+static int node_new(struct libp_tree *t, int id, int metric)
 {
-    root = NULL;
-    int k = 0;
-    for(k = 0; k <128; k++)
+    struct Node *n;
+    int i;
+
+    if(t->free_nodes != NODE_NONE)
     {
-        //created[k] = 0;
-        advertised[k] = -1;
-        calculated[k] = -1;
-        nodes[k] = NULL;
+        i = t->free_nodes;
+        t->free_nodes = t->nodes[i].nextsibling;
+        t->num_free--;
     }
-    struct Node *r;
-    r = (struct Node *)malloc(sizeof(struct Node));
-    r->id = 0;
-    r->metric = -1;
-    r->firstchild = NULL;
-    r->nextsibling = NULL;
-    root = r;
-    nodes[0] = r;
-    init_visited();
-
+    else
+    {
+        if(!arena_grow(t))
+        {
+            return NODE_NONE;
+        }
+        i = t->num_nodes++;
+    }
+    n = &t->nodes[i];
+    n->id = id;
+    n->metric = metric;
+    n->parent = NODE_NONE;
+    n->firstchild = NODE_NONE;
+    n->lastchild = NODE_NONE;
+    n->prevsibling = NODE_NONE;
+    n->nextsibling = NODE_NONE;
+    n->visited = 0;
+    n->advertised = -1;
+    n->calculated = -1;
+    n->children = 0;
+    n->descendants = 0;
+    n->load = 1;
+    n->subtree_load = 1;
+    t->index_slots[index_lookup(t, id)] = i;
+    n->heappos = t->heap_size++;
+    heap_set(t, n->heappos, i);
+    heap_up(t, i);
+    return i;
 }
 
+//removes id from the hash index, shifting back the entries that probed past it
+static void index_remove(struct libp_tree *t, int id)
+{
+    int s, j, h;
+
+    s = index_lookup(t, id);
+    if(t->index_slots[s] == NODE_NONE)
+    {
+        return;
+    }
+    t->index_slots[s] = NODE_NONE;
+    j = s;
+    while(1)
+    {
+        j = (j + 1) & (t->num_slots - 1);
+        if(t->index_slots[j] == NODE_NONE)
+        {
+            return;
+        }
+        h = hash_slot(t, t->nodes[t->index_slots[j]].id);
+        //the entry may move to s if s lies between its home slot and j
+        if(((j - h) & (t->num_slots - 1)) >= ((j - s) & (t->num_slots - 1)))
+        {
+            t->index_slots[s] = t->index_slots[j];
+            t->index_slots[j] = NODE_NONE;
+            s = j;
+        }
+    }
+}
 
-struct Node * get_root()
+//adds descendants and load to node p and all its ancestors
+static void path_add(struct libp_tree *t, int p, int descendants, int load)
 {
-    return root;
+    while(p != NODE_NONE)
+    {
+        t->nodes[p].descendants += descendants;
+        t->nodes[p].subtree_load += load;
+        if(load > 0)
+        {
+            heap_up(t, p);
+        }
+        else if(load < 0)
+        {
+            heap_down(t, p);
+        }
+        p = t->nodes[p].parent;
+    }
 }
 
+//unlinks node i from its parent and siblings, keeping its subtree
+static void node_detach(struct libp_tree *t, int i)
+{
+    struct Node *n = &t->nodes[i];
 
+    if(n->parent == NODE_NONE)
+    {
+        return;
+    }
+    t->nodes[n->parent].children--;
+    path_add(t, n->parent, -(1 + n->descendants), -n->subtree_load);
+    if(n->prevsibling != NODE_NONE)
+    {
+        t->nodes[n->prevsibling].nextsibling = n->nextsibling;
+    }
+    else
+    {
+        t->nodes[n->parent].firstchild = n->nextsibling;
+    }
+    if(n->nextsibling != NODE_NONE)
+    {
+        t->nodes[n->nextsibling].prevsibling = n->prevsibling;
+    }
+    else
+    {
+        t->nodes[n->parent].lastchild = n->prevsibling;
+    }
+    n->parent = NODE_NONE;
+    n->prevsibling = NODE_NONE;
+    n->nextsibling = NODE_NONE;
+}
 
-void change_node_metric(int id, int metric)
+//appends the detached node i to the children of p
+static void node_attach(struct libp_tree *t, int i, int p)
 {
-    if(nodes[id] != NULL)
+    struct Node *n = &t->nodes[i];
+
+    n->parent = p;
+    n->prevsibling = t->nodes[p].lastchild;
+    n->nextsibling = NODE_NONE;
+    if(t->nodes[p].lastchild != NODE_NONE)
+    {
+        t->nodes[t->nodes[p].lastchild].nextsibling = i;
+    }
+    else
     {
-        nodes[id]->metric = metric;
+        t->nodes[p].firstchild = i;
     }
+    t->nodes[p].lastchild = i;
+    t->nodes[p].children++;
+    path_add(t, p, 1 + n->descendants, n->subtree_load);
 }
 
-void change_node_parent(int id, int new_parent)
+//returns the arena index of the node with id, adding a placeholder if it is not in the tree
+static int node_find_or_add(struct libp_tree *t, int id)
 {
-    //TODO
+    int i = node_index(t, id);
+    if(i == NODE_NONE)
+    {
+        i = node_new(t, id, -1);
+    }
+    return i;
 }
 
-void dfs_clear(struct Node * n)
+//moves node i below the node with id parent
+static int node_move(struct libp_tree *t, int i, int parent)
 {
-    int id = n->id;
-    bfs_count = bfs_count + 1;
-    visited[id] = bfs_count;
-    struct Node * c = n->firstchild;
-    while(c != NULL)
+    int p, a;
+
+    p = node_find_or_add(t, parent);
+    if(p == NODE_NONE || p == i || t->nodes[i].parent == p)
     {
-        if(visited[c->id] == 0);
+        return p != NODE_NONE;
+    }
+    //refuse to move the node below itself, which would cut its subtree off in a loop
+    for(a = t->nodes[p].parent; a != NODE_NONE; a = t->nodes[a].parent)
+    {
+        if(a == i)
         {
-            dfs_clear(c);
+            return 0;
         }
-        struct Node *tmp = c;
-        c = tmp->nextsibling;
     }
-    printf("free-ing %d \n",n->id);
-    //n->firstchild = NULL;
-    //n->nextsibling = NULL;
-    free(n);
-    nodes[id] = NULL;
-
+    node_detach(t, i);
+    node_attach(t, i, p);
+    return 1;
 }
 
-void clear_tree()
+void init_visited(struct libp_tree *t)
 {
+    int k = 0;
+    for(k = 0; k < t->num_nodes; k++)
+    {
+        t->nodes[k].visited = 0;
+    }
+}
 
-    init_visited();
-    bfs_count = 0; //actually for DFS but it doesnt matter used for the same purpose
-    int k;
-    for(k = 0; k < 128; k++)
+void bfs(struct libp_tree *t, struct Node * v)
+{
+    struct queue q;
+
+    //every node is pushed at most once, so the queue cannot overflow
+    queue_init(&q, t->bfs_items, t->num_nodes);
+    queue_push(&q, v - t->nodes);
+    t->bfs_count = t->bfs_count + 1;
+    v->visited = t->bfs_count;
+    int queue_size = queue_getSize(&q);
+    while(queue_size > 0)
     {
-        if(nodes[k] != NULL)
+        //get all children incident to parent
+        int kids;
+        kids = 0;
+        struct Node *p = &t->nodes[queue_dequeue(&q)];
+        int c = p->firstchild;
+
+        while(c != NODE_NONE)
         {
-            if(visited[k] == 0)
+            if(t->nodes[c].visited == 0)
             {
-                printf("%d\n",k);
-                dfs_clear(nodes[k]);
+                t->bfs_count = t->bfs_count + 1;
+                t->nodes[c].visited = t->bfs_count;
+                queue_push(&q, c);
+                kids++;
             }
+            c = t->nodes[c].nextsibling;
         }
+        //printf("Number of kids for Node %d is %d\n",p->id,kids);
+        p->calculated = kids;
+        queue_size = queue_getSize(&q);
     }
+}
 
+void tree_bfs(struct libp_tree *t)
+{
+    t->bfs_count = 0;
+    init_visited(t);
+    int k;
+    for(k = 0; k < t->num_nodes; k++)
+    {
+        //only the roots of the trees are seeded, a child can sit before its
+        //parent in the arena and must be counted through it
+        if(t->nodes[k].visited == 0 && t->nodes[k].parent == NODE_NONE)
+        {
+            bfs(t, &t->nodes[k]);
+        }
+    }
 
 
 }
 
-void add_node(int parent, int metric, int id)
+int tree_init(struct libp_tree *t)
 {
-    struct Node *n;
-    n = (struct Node *)malloc(sizeof(struct Node));
-    n->id = id;
-    n->metric = metric;
-    //printf("------ adding node %d ------\n", id);
-    nodes[id] = n;
-    n->firstchild = NULL;
-    n->nextsibling = NULL;
-    if(!nodes[parent]) //if nodes[parent] == null or if nodes[parent] does not point to something
-    {
-        //create parent placeholder
-        struct Node *p;
-        p = (struct Node *)malloc(sizeof(struct Node));
-        p->id = parent;
-        p->metric = -1;
-        p->firstchild = n;
-        p->nextsibling = NULL;
-        //{parent,-1, n, NULL}; //add child to parent as well
-        nodes[parent] = p;
-        //printf("added to parent placeholder node:%d parent:%d \n", id, parent);
+    memset(t, 0, sizeof(struct libp_tree));
+    t->free_nodes = NODE_NONE;
+    if(node_new(t, 0, -1) == NODE_NONE)
+    {
+        return 0;
     }
-    else
+    return 1;
+}
+
+
+struct Node * get_root(struct libp_tree *t)
+{
+    return t->num_nodes > 0 ? &t->nodes[0] : NULL;
+}
+
+struct Node * tree_node(struct libp_tree *t, int id)
+{
+    int i = node_index(t, id);
+    return i != NODE_NONE ? &t->nodes[i] : NULL;
+}
+
+int tree_size(struct libp_tree *t)
+{
+    return t->num_nodes - t->num_free;
+}
+
+void change_node_metric(struct libp_tree *t, int id, int metric)
+{
+    struct Node *n = tree_node(t, id);
+    if(n != NULL)
     {
-        if(!nodes[parent]->firstchild)
-        {
-            //add to first child
-            nodes[parent]->firstchild = nodes[id];
-            //printf("added to first child node:%d parent:%d \n", id, parent);
-        }
-        else
-        {
-            //printf("node %d has first child %d, adding to sibling\n",parent, nodes[parent]->firstchild->id);
-            //add to child's next sibling
-            struct Node *child = nodes[parent]->firstchild;
-            //printf("added to next sibling node:%d parent:%d \n", id, parent);
-            while(child->nextsibling)
-            {
-                //printf("sibling %d \n", child->id);
-                child = child->nextsibling;
-            }
-            child->nextsibling = nodes[id];
+        n->metric = metric;
+    }
+}
 
+void change_node_load(struct libp_tree *t, int id, int load)
+{
+    int i = node_index(t, id);
+    int delta;
 
-        }
+    if(i == NODE_NONE)
+    {
+        return;
     }
+    delta = load - t->nodes[i].load;
+    t->nodes[i].load = load;
+    t->nodes[i].subtree_load += delta;
+    path_add(t, t->nodes[i].parent, 0, delta);
+}
+
+int remove_node(struct libp_tree *t, int id)
+{
+    int i = node_index(t, id);
 
+    if(i == NODE_NONE || i == 0)
+    {
+        return 0;
+    }
+    node_detach(t, i);
+    while(t->nodes[i].firstchild != NODE_NONE)
+    {
+        node_detach(t, t->nodes[i].firstchild);
+    }
+    index_remove(t, id);
+    heap_remove(t, i);
+    t->nodes[i].parent = NODE_FREE;
+    t->nodes[i].nextsibling = t->free_nodes;
+    t->free_nodes = i;
+    t->num_free++;
+    return 1;
 }
 
-void print_nodes()
+struct Node * busiest_node(struct libp_tree *t)
 {
-    int k;
-    for(k = 0; k < 128; k++)
+    if(t->heap_size == 0 || forwarded(t, t->heap[0]) <= 0)
     {
-        int fc, ns;
-        if(nodes[k])
+        return NULL;
+    }
+    return &t->nodes[t->heap[0]];
+}
+
+void change_node_parent(struct libp_tree *t, int id, int new_parent)
+{
+    int i = node_index(t, id);
+    if(i != NODE_NONE && i != 0)
+    {
+        node_move(t, i, new_parent);
+    }
+}
+
+void clear_tree(struct libp_tree *t)
+{
+    free(t->nodes);
+    free(t->index_slots);
+    free(t->bfs_items);
+    free(t->heap);
+    memset(t, 0, sizeof(struct libp_tree));
+    t->free_nodes = NODE_NONE;
+}
+
+int tree_copy(struct libp_tree *dst, const struct libp_tree *src)
+{
+    memset(dst, 0, sizeof(struct libp_tree));
+    dst->free_nodes = NODE_NONE;
+    if(src->max_nodes > 0)
+    {
+        dst->nodes = (struct Node *)malloc(src->max_nodes * sizeof(struct Node));
+        dst->bfs_items = (int *)malloc(src->max_nodes * sizeof(int));
+        dst->index_slots = (int *)malloc(src->num_slots * sizeof(int));
+        dst->heap = (int *)malloc(src->max_nodes * sizeof(int));
+        if(dst->nodes == NULL || dst->bfs_items == NULL || dst->index_slots == NULL ||
+           dst->heap == NULL)
         {
-            if(!nodes[k]->firstchild)
-            {
-                fc = -1;
-            }
-            else
-            {
-                fc = nodes[k]->firstchild->id;
-            }
-            if(!nodes[k]->nextsibling)
-            {
-                ns = -1;
-            }
-            else
-            {
-                ns = nodes[k]->nextsibling->id;
-            }
-            //printf("Node[%d] fc %d ns %d \n",k,fc,ns);
+            clear_tree(dst);
+            return 0;
         }
-
+        memcpy(dst->nodes, src->nodes, src->max_nodes * sizeof(struct Node));
+        memcpy(dst->index_slots, src->index_slots, src->num_slots * sizeof(int));
+        memcpy(dst->heap, src->heap, src->heap_size * sizeof(int));
     }
+    dst->num_nodes = src->num_nodes;
+    dst->max_nodes = src->max_nodes;
+    dst->num_slots = src->num_slots;
+    dst->slot_shift = src->slot_shift;
+    dst->bfs_count = src->bfs_count;
+    dst->free_nodes = src->free_nodes;
+    dst->num_free = src->num_free;
+    dst->heap_size = src->heap_size;
+    return 1;
 }
 
+int add_node(struct libp_tree *t, int parent, int metric, int id)
+{
+    int i;
 
+    //printf("------ adding node %d ------\n", id);
+    i = node_find_or_add(t, id);
+    if(i == NODE_NONE)
+    {
+        return 0;
+    }
+    t->nodes[i].metric = metric;
+    if(i == 0)
+    {
+        //the root has no parent
+        return 1;
+    }
+    return node_move(t, i, parent);
+}
 
+void print_nodes(struct libp_tree *t)
+{
+    int k;
+    for(k = 0; k < t->num_nodes; k++)
+    {
+        int fc, ns;
+        if(t->nodes[k].parent == NODE_FREE)
+        {
+            continue;
+        }
+        fc = t->nodes[k].firstchild != NODE_NONE ? t->nodes[t->nodes[k].firstchild].id : -1;
+        ns = t->nodes[k].nextsibling != NODE_NONE ? t->nodes[t->nodes[k].nextsibling].id : -1;
+        printf("Node[%d] fc %d ns %d \n", t->nodes[k].id, fc, ns);
+    }
+}
@@ -9,53 +9,155 @@
 #ifndef TREE_H
 #define TREE_H
 
-#include "tree.h"
 #include "node.h"
 
-struct Node *root; //gateway Node
-struct Node *nodes[128]; //holds an ordered list of all the nodes in the network
-int visited[128]; //keeps track of visited nodes in bfs algorithm
-int advertised[128]; //holds the children weight for the advertised weight
-int calculated[128]; //holds the children weight for the calculated bfs amount
-int bfs_count; //placeholder variable for the visited calculations of bfs
+/**
+ * \struct libp_tree
+ * \properties:
+ *	nodes - the arena that holds all the nodes in the network, the root first
+ *      num_nodes - the number of nodes in the arena, removed ones included
+ *      max_nodes - the number of nodes the arena has room for
+ *      index_slots - open addressing hash index from node id to arena index,
+ *                    NODE_NONE for an empty slot
+ *      num_slots - the size of the index, twice max_nodes so it is never more than half full
+ *      slot_shift - 32 - log2(num_slots), the shift that takes the top bits of the hash
+ *      bfs_items - ring buffer for the bfs queue, grown with the arena so a bfs never allocates
+ *      bfs_count - placeholder variable for the visited calculations of bfs
+ *      free_nodes - the first removed node, the rest are linked through nextsibling
+ *      num_free - the number of removed nodes
+ *      heap - max-heap of the arena indices of all nodes in the tree, keyed on the
+ *             load each node forwards for its subtree, so the busiest node is heap[0]
+ *      heap_size - the number of nodes in the heap
+ *
+ *      All the state of one topology. A gateway may keep as many as it likes;
+ *      the functions below only touch the tree they are given.
+ */
+
+struct libp_tree
+{
+    struct Node *nodes;
+    int num_nodes;
+    int max_nodes;
+    int *index_slots;
+    int num_slots;
+    int slot_shift;
+    int *bfs_items;
+    int bfs_count;
+    int free_nodes;
+    int num_free;
+    int *heap;
+    int heap_size;
+};
+
+/*
+ * The nodes of the tree are kept in an arena that grows as nodes are
+ * added, and are found by id through a hash index, so ids may be any
+ * rime address. Pointers to nodes are only valid until the next node
+ * is added, since the arena may move when it grows.
+ *
+ * Every node keeps its number of children and descendants and the
+ * traffic load of its subtree. These are updated along the path to the
+ * root whenever a node is added, moved, removed or changes its load, so
+ * reading them costs nothing.
+ */
 
 /**
- * \brief      Initialize the queue
+ * \brief      Initialize the tree
+ * \return     1 on success, 0 if the memory for the root could not be allocated
  *
- *             This function initializes the queue
+ *             This function initializes the tree with only the root node, with id 0.
+ *             A tree that was in use has to be cleared with clear_tree() first
  */
-void tree_init();
+int tree_init(struct libp_tree *t);
 
 /**
- * \brief      Initialize the queue
+ * \brief      Adds a node
  * \param
+ *      t      the tree
  *      parent the parent
  *      metric the metric/weight of the node with id param:id
  *      id     the id of the node
+ * \return     1 on success, 0 if the tree could not grow
  *
- *             This function adds a node to the tree structure
+ *             This function adds a node to the tree structure. A parent that is not
+ *             in the tree yet is added as a placeholder with metric -1. Adding a node
+ *             that is already in the tree updates its metric and moves it to parent.
+ *             A new node has a load of 1.
  */
-void add_node(int parent, int metric, int id);
+int add_node(struct libp_tree *t, int parent, int metric, int id);
+
+/**
+ * \brief      Getter for a node
+ * \param
+ *      t      the tree
+ *      id     the id of the node
+ * \return     The node with id param:id, or NULL if it is not in the tree
+ */
+struct Node * tree_node(struct libp_tree *t, int id);
+
+/**
+ * \brief      Getter for the number of nodes
+ * \return     The number of nodes in the tree, placeholders and root included
+ */
+int tree_size(struct libp_tree *t);
 
 /**
  * \brief      Setter for node metric
  * \param
+ *      t      the tree
  *      metric the metric/weight of the node with id param:id
  *      id     the id of the node
  *
  *             sets the node metric for a given id param:id
  */
-void change_node_metric(int id, int metric);
+void change_node_metric(struct libp_tree *t, int id, int metric);
 
 /**
  * \brief      Setter for node parent
  * \param
+ *      t      the tree
  *      parent the parent of the node with id param:id
  *      id     the id of the node
  *
- *             sets the node new parent for a given id param:id
+ *             sets the node new parent for a given id param:id, in constant time. The
+ *             node keeps its subtree. A parent that is not in the tree yet is added as
+ *             a placeholder. A move that would put the node below its own subtree is
+ *             refused
+ */
+void change_node_parent(struct libp_tree *t, int id, int new_parent);
+
+/**
+ * \brief      Setter for node load
+ * \param
+ *      t      the tree
+ *      id     the id of the node
+ *      load   the traffic load the node generates
+ *
+ *             sets the load of the node and updates the subtree loads up to the root
+ */
+void change_node_load(struct libp_tree *t, int id, int load);
+
+/**
+ * \brief      Removes a node
+ * \param
+ *      t      the tree
+ *      id     the id of the node
+ * \return     1 if the node was removed, 0 if it is not in the tree or is the root
+ *
+ *             Removes the node from the tree. Its children stay in the tree with their
+ *             subtrees but without a parent, until they are given a new one
  */
-void change_node_parent(int id, int new_parent);
+int remove_node(struct libp_tree *t, int id);
+
+/**
+ * \brief      Getter for the busiest router
+ * \return     The node that forwards the most traffic load for its subtree, or NULL
+ *             if no node forwards anything
+ *
+ *             The nodes are kept in a max-heap on the load they forward, which is
+ *             updated along with the counts, so the answer is read off its top
+ */
+struct Node * busiest_node(struct libp_tree *t);
 
 /**
  * \brief      starts the bfs process
@@ -63,16 +165,17 @@ void change_node_parent(int id, int new_parent);
  *
  *             Starts a breadth first search
  */
-void tree_bfs();
+void tree_bfs(struct libp_tree *t);
 
 /**
  * \brief      bfs process
  * \param
+ *      t      the tree
  *      v      The vertex to begin the bfs from
  *
  *             Starts a breadth first search from this node (used by tree_bfs() should not be called otherwise
  */
-void bfs(struct Node * v);
+void bfs(struct libp_tree *t, struct Node * v);
 
 /**
  * \brief      Getter for tree root node
@@ -81,15 +184,27 @@ void bfs(struct Node * v);
  *
  *             Returns the root node of the tree
  */
-struct Node * get_root();
+struct Node * get_root(struct libp_tree *t);
 
 /**
  * \brief      Clears the tree of all nodes
- * \return
- *      root   The root node of the tree
  *
- *             Clears the tree of all nodes and free()'s the space created for the node structs
+ *             Clears the tree of all nodes and free()'s the arena and the index.
+ *             tree_init() has to be called before the tree is used again
+ */
+void clear_tree(struct libp_tree *t);
+
+/**
+ * \brief      Copies a tree
+ * \param
+ *      t      the tree
+ *      dst    the tree to copy to, which must not be in use
+ *      src    the tree to copy
+ * \return     1 on success, 0 if the memory could not be allocated
+ *
+ *             Takes a snapshot of src that can be read while src keeps changing.
+ *             The copy has to be cleared with clear_tree() when it is no longer needed
  */
-void clear_tree();
+int tree_copy(struct libp_tree *dst, const struct libp_tree *src);
 
 #endif